@@ -3,6 +3,10 @@
 #include <stack>
 #include <algorithm>
 #include <limits>
+#include <atomic>
+#include <thread>
+#include <filesystem>
+#include <cstring>
 
 #include "stb_image.h"
 
@@ -26,10 +30,20 @@ std::string read_file(std::string filepath)
     return buffer.str();
 }
 
-uint32_t create_shader(std::string vertex_file, std::string fragment_file)
+std::string insert_shader_defines(std::string source, const std::string& defines)
 {
-    std::string vertex_source = read_file(vertex_file);
-    std::string fragment_source = read_file(fragment_file);
+    size_t version_end = source.find('\n');
+    if (defines.empty() || version_end == std::string::npos)
+    {
+        return source;
+    }
+    return source.insert(version_end + 1, defines);
+}
+
+uint32_t create_shader(std::string vertex_file, std::string fragment_file, std::string defines)
+{
+    std::string vertex_source = insert_shader_defines(read_file(vertex_file), defines);
+    std::string fragment_source = insert_shader_defines(read_file(fragment_file), defines);
     const char* vert_str = vertex_source.c_str();
     const char* frag_str = fragment_source.c_str();
 
@@ -75,406 +89,805 @@ uint32_t create_shader(std::string vertex_file, std::string fragment_file)
 
 
 
-void clay_init_render_ctx(ClayRenderCtx* ctx, std::vector<std::string> image_filepaths, std::vector<std::string> font_filepaths)
+void reserve_quad_indices(ClayRenderCtx* ctx, uint32_t quad_count)
 {
-    ctx->text_shader = create_shader("src/shaders/text.vert", "src/shaders/text.frag");
-    glGenVertexArrays(1, &ctx->text_VAO);
-    glGenBuffers(1, &ctx->text_VBO);
-    glBindVertexArray(ctx->text_VAO);
-    glBindBuffer(GL_ARRAY_BUFFER, ctx->text_VBO);
-    glBufferData(GL_ARRAY_BUFFER, 0, nullptr, GL_STREAM_DRAW);
-    glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 4 * sizeof(float), (void*)0);
-    glEnableVertexAttribArray(0);
-    glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 4 * sizeof(float), (void*)(2 * sizeof(float)));
-    glEnableVertexAttribArray(1);
-    glBindVertexArray(0);
-
-    ctx->rect_shader = create_shader("src/shaders/rect.vert", "src/shaders/rect.frag");
-    glGenVertexArrays(1, &ctx->rect_VAO);
-    glGenBuffers(1, &ctx->rect_VBO);
-    glBindVertexArray(ctx->rect_VAO);
-    glBindBuffer(GL_ARRAY_BUFFER, ctx->rect_VBO);
-    glBufferData(GL_ARRAY_BUFFER, 0, nullptr, GL_STREAM_DRAW);
-    glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 8 * sizeof(float), (void*)0);
-    glEnableVertexAttribArray(0);
-    glVertexAttribPointer(1, 4, GL_FLOAT, GL_FALSE, 8 * sizeof(float), (void*)(2 * sizeof(float)));
-    glEnableVertexAttribArray(1);
-    glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, 8 * sizeof(float), (void*)(6 * sizeof(float)));
-    glEnableVertexAttribArray(2);
-    glBindVertexArray(0);
+    if (quad_count <= ctx->quad_index_capacity)
+    {
+        return;
+    }
 
-    for (const auto& filepath : image_filepaths) 
+    uint32_t capacity = std::max(quad_count, ctx->quad_index_capacity * 2);
+    std::vector<uint32_t> indices(capacity * 6);
+    for (uint32_t i = 0; i < capacity; i++)
     {
-        int width, height, channels;
-        unsigned char* data = stbi_load(filepath.c_str(), &width, &height, &channels, 4);
-        if (!data) 
-        {
-            std::cout << "Failed to load image: " << filepath << std::endl;
-            continue;
-        }
+        uint32_t vertex = i * 4;
+        indices[i * 6 + 0] = vertex + 0;
+        indices[i * 6 + 1] = vertex + 1;
+        indices[i * 6 + 2] = vertex + 2;
+        indices[i * 6 + 3] = vertex + 0;
+        indices[i * 6 + 4] = vertex + 2;
+        indices[i * 6 + 5] = vertex + 3;
+    }
 
-        uint32_t texture;
-        glGenTextures(1, &texture);
-        glBindTexture(GL_TEXTURE_2D, texture);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, data);
-        glGenerateMipmap(GL_TEXTURE_2D);
+    // The VAO records the element buffer binding
+    gl_bind_vertex_array(&ctx->gl, ctx->quad_VAO);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ctx->quad_EBO);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(uint32_t), indices.data(), GL_STATIC_DRAW);
 
-        stbi_image_free(data);
+    ctx->quad_index_capacity = capacity;
+}
 
-        ctx->texture_ids[filepath] = texture;
+ClayImageHandle clay_register_image(ClayRenderCtx* ctx, std::string filepath)
+{
+    auto it = ctx->image_handles.find(filepath);
+    if (it != ctx->image_handles.end())
+    {
+        return it->second;
     }
 
-    unsigned char white_data[] = {255, 255, 255, 255};
-    uint32_t white_texture;
-    glGenTextures(1, &white_texture);
-    glBindTexture(GL_TEXTURE_2D, white_texture);
+    int width, height, channels;
+    unsigned char* data = stbi_load(filepath.c_str(), &width, &height, &channels, 4);
+    if (!data) 
+    {
+        std::cout << "Failed to load image: " << filepath << std::endl;
+        return 0;
+    }
+
+    uint32_t texture;
+    glGenTextures(1, &texture);
+    glBindTexture(GL_TEXTURE_2D, texture);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, 1, 1, 0, GL_RGBA, GL_UNSIGNED_BYTE, white_data);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, data);
     glGenerateMipmap(GL_TEXTURE_2D);
 
-    ctx->texture_ids["white"] = white_texture;
-    
-    uint16_t font_sizes[] = { 12, 14, 16, 20, 24, 32, 44, 64 };
-    for (uint32_t i = 0; i < font_filepaths.size(); i++)
+    stbi_image_free(data);
+
+    // Texture bindings changed behind the state cache
+    gl_state_reset(&ctx->gl);
+
+    ctx->image_textures.push_back(texture);
+    ClayImageHandle handle = static_cast<ClayImageHandle>(ctx->image_textures.size());
+    ctx->image_handles[filepath] = handle;
+    return handle;
+}
+
+ClayImageHandle get_image_handle(ClayRenderCtx* ctx, std::string filepath)
+{
+    auto it = ctx->image_handles.find(filepath);
+    return it != ctx->image_handles.end() ? it->second : 0;
+}
+
+void clay_init_render_ctx(ClayRenderCtx* ctx, std::vector<std::string> image_filepaths, std::vector<std::string> font_filepaths)
+{
+    // No vertex attributes, ui.vert pulls each quad from quad_texture using gl_VertexID / 4
+    ctx->quad_record_size = ctx->compact_quads ? sizeof(ClayCompactQuad) : sizeof(ClayQuad);
+    ctx->quad_shader = create_shader("src/shaders/ui.vert", "src/shaders/ui.frag", ctx->compact_quads ? "#define CLAY_COMPACT_QUADS\n" : "");
+    ctx->projection_location = glGetUniformLocation(ctx->quad_shader, "projection");
+    glUseProgram(ctx->quad_shader);
+    glUniform1i(glGetUniformLocation(ctx->quad_shader, "tex_sampler"), 0);
+    glUniform1i(glGetUniformLocation(ctx->quad_shader, "character_atlas"), 1);
+    glUniform1i(glGetUniformLocation(ctx->quad_shader, "quads"), 2);
+    glUniform1i(glGetUniformLocation(ctx->quad_shader, "glyph_metrics"), 3);
+    ctx->glyph_mode_location = glGetUniformLocation(ctx->quad_shader, "glyph_mode");
+    glUniform1ui(ctx->glyph_mode_location, 0);
+    ctx->uploaded_glyph_mode = 0;
+    gl_state_reset(&ctx->gl);
+    glGenVertexArrays(1, &ctx->quad_VAO);
+    glGenBuffers(1, &ctx->quad_EBO);
+    reserve_quad_indices(ctx, 16384);
+
+    // Regions hold whole quads, and both quad sizes are multiples of a ClayGlyphInstance, so a batch aligned to its
+    // record size inside a region is aligned in the whole buffer
+    stream_buffer_init(&ctx->quad_stream, (1 << 20) / ctx->quad_record_size * ctx->quad_record_size);
+    glGenTextures(1, &ctx->quad_texture);
+
+    for (const auto& filepath : image_filepaths) 
+    {
+        clay_register_image(ctx, filepath);
+    }
+
+    font_library_init(&ctx->font_library);
+
+    // Atlases are built the first time a font and size is measured or drawn, see clay_warm_up_fonts
+    for (const auto& filepath : font_filepaths)
+    {
+        ClayFont font;
+        font.filepath = filepath;
+        ctx->fonts.push_back(font);
+    }
+
+    Clay_SetMeasureTextFunction(MeasureText, ctx);
+}
+
+// False when the cache is disabled. Creates the cache directory, safe to call from worker threads
+bool baked_atlas_location(ClayRenderCtx* ctx, const FontFace* font, uint16_t atlas_size, std::string* filepath, uint64_t* key)
+{
+    if (ctx->atlas_cache_dir.empty() || !font)
+    {
+        return false;
+    }
+
+    std::error_code error;
+    std::filesystem::create_directories(ctx->atlas_cache_dir, error);
+
+    char name[32];
+    *key = baked_atlas_key(font, atlas_size, ctx->sdf_text);
+    snprintf(name, sizeof(name), "%016llx.atlas", static_cast<unsigned long long>(*key));
+    *filepath = (std::filesystem::path(ctx->atlas_cache_dir) / name).string();
+    return true;
+}
+
+// Sizes above CLAY_EXACT_ATLAS_FONT_SIZE round up to one of these and are drawn scaled down, so animated or
+// zoomed text builds at most CLAY_EXACT_ATLAS_FONT_SIZE plus a handful of atlases per font
+static const uint16_t CLAY_ATLAS_SIZE_BUCKETS[] = { 36, 40, 44, 48, 56, 64, 72, 80, 96, 112, 128, 160, 192, 224, CLAY_MAX_ATLAS_FONT_SIZE };
+
+// Pixel size of the atlas slot serving font_size
+static uint16_t atlas_size_for(ClayRenderCtx* ctx, uint16_t font_size)
+{
+    if (ctx->sdf_text)
+    {
+        return std::min(ctx->sdf_pixel_size, CLAY_MAX_ATLAS_FONT_SIZE);
+    }
+    if (font_size <= CLAY_EXACT_ATLAS_FONT_SIZE)
+    {
+        return font_size;
+    }
+    for (uint16_t bucket : CLAY_ATLAS_SIZE_BUCKETS)
     {
-        std::string filepath = font_filepaths[i];
-        for (const auto& font_size : font_sizes)
+        if (font_size <= bucket)
         {
-            CharacterAtlas atlas;
-            create_character_atlas(&atlas, filepath, font_size);
-            ctx->character_atlases[filepath][font_size] = atlas;
-            ctx->fonts.push_back(filepath);
+            return bucket;
         }
     }
+    return CLAY_MAX_ATLAS_FONT_SIZE;
+}
 
-    Clay_SetMeasureTextFunction(MeasureText, ctx);
+// Failed atlases are remembered so they are not rebuilt on every lookup
+static void store_atlas(ClayRenderCtx* ctx, uint16_t font_id, uint16_t atlas_size, std::unique_ptr<CharacterAtlas> atlas, bool built)
+{
+    uint16_t& slot = ctx->fonts[font_id].atlas_slots[atlas_size];
+    if (!built)
+    {
+        slot = CLAY_ATLAS_FAILED;
+        return;
+    }
+    ctx->atlases.push_back(std::move(atlas));
+    slot = static_cast<uint16_t>(ctx->atlases.size());
 }
 
-glm::vec4 normalize_clay_color(Clay_Color color)
+static void build_font_atlas(ClayRenderCtx* ctx, uint16_t font_id, uint16_t atlas_size)
 {
-    return { color.r / 255.0f, color.g / 255.0f, color.b / 255.0f, color.a / 255.0f };
+    std::unique_ptr<CharacterAtlas> atlas = std::make_unique<CharacterAtlas>();
+    FontFace* font = font_library_open(&ctx->font_library, ctx->fonts[font_id].filepath);
+    std::string baked_filepath;
+    uint64_t key;
+    bool built = false;
+    if (baked_atlas_location(ctx, font, atlas_size, &baked_filepath, &key) && load_baked_atlas(atlas.get(), baked_filepath, key) == 0)
+    {
+        built = finish_character_atlas(atlas.get(), font) == 0;
+    }
+    else if (create_character_atlas(atlas.get(), font, atlas_size, ctx->sdf_text) == 0)
+    {
+        built = true;
+        if (!baked_filepath.empty())
+        {
+            save_baked_atlas(atlas.get(), baked_filepath, key);
+        }
+    }
+    store_atlas(ctx, font_id, atlas_size, std::move(atlas), built);
+
+    // Creation binds the new texture behind ClayGLState
+    gl_state_reset(&ctx->gl);
 }
 
-struct Quad
+// Closest built slot, larger sizes first since scaling down looks better. CLAY_ATLAS_NONE if the font has none
+static uint16_t nearest_atlas_slot(const ClayFont& font, uint16_t atlas_size)
 {
-    glm::vec2 v0;
-    glm::vec2 v1;
-    glm::vec2 v2;
-    glm::vec2 v3;
-};
-struct Arc
+    for (int distance = 1; distance <= CLAY_MAX_ATLAS_FONT_SIZE; distance++)
+    {
+        int sizes[] = { atlas_size + distance, atlas_size - distance };
+        for (int size : sizes)
+        {
+            if (size < 1 || size > CLAY_MAX_ATLAS_FONT_SIZE)
+            {
+                continue;
+            }
+            uint16_t slot = font.atlas_slots[size];
+            if (slot != CLAY_ATLAS_NONE && slot != CLAY_ATLAS_FAILED)
+            {
+                return slot;
+            }
+        }
+    }
+    return CLAY_ATLAS_NONE;
+}
+
+CharacterAtlas* find_character_atlas(ClayRenderCtx* ctx, uint16_t font_id, uint16_t font_size, float* scale)
 {
-    glm::vec2 pos;
-    float radius;
-    float width_start;
-    float width_end;
-    glm::vec4 color;
-    float start;
-    float end;
-};
+    font_id &= ~CLAY_NUMERIC_FONT;
+    if (font_id >= ctx->fonts.size() || font_size == 0)
+    {
+        return nullptr;
+    }
+
+    uint16_t atlas_size = atlas_size_for(ctx, font_size);
+    if (atlas_size == 0)
+    {
+        return nullptr;
+    }
+
+    uint16_t slot = ctx->fonts[font_id].atlas_slots[atlas_size];
+    if (slot == CLAY_ATLAS_NONE)
+    {
+        build_font_atlas(ctx, font_id, atlas_size);
+        slot = ctx->fonts[font_id].atlas_slots[atlas_size];
+    }
+    if (slot == CLAY_ATLAS_FAILED)
+    {
+        slot = nearest_atlas_slot(ctx->fonts[font_id], atlas_size);
+        if (slot == CLAY_ATLAS_NONE)
+        {
+            return nullptr;
+        }
+    }
 
-const float PI = 3.14159f;
+    CharacterAtlas* atlas = ctx->atlases[slot - 1].get();
+    *scale = (float)font_size / (float)atlas->pixel_size;
+    return atlas;
+}
 
-void add_rect_vertex(ClayRenderCtx* ctx, glm::vec2 pos, glm::vec4 color, Rect bb)
+void clay_warm_up_fonts(ClayRenderCtx* ctx, const std::vector<ClayFontSize>& font_sizes)
 {
-    ctx->rect_vertices.push_back({
-        pos,
-        color,
-        { (pos.x - bb.left) / (bb.right - bb.left), (pos.y - bb.top) / (bb.bot - bb.top) }
-    });
+    struct WarmUpJob
+    {
+        uint16_t font_id;
+        uint16_t atlas_size;
+        FontFace* font;
+        std::unique_ptr<CharacterAtlas> atlas;
+        bool built;
+    };
+
+    std::vector<WarmUpJob> jobs;
+    for (ClayFontSize font_size : font_sizes)
+    {
+        font_size.font_id &= ~CLAY_NUMERIC_FONT;
+        if (font_size.font_id >= ctx->fonts.size() || font_size.font_size == 0)
+        {
+            continue;
+        }
+
+        uint16_t atlas_size = atlas_size_for(ctx, font_size.font_size);
+        bool queued = std::any_of(jobs.begin(), jobs.end(), [&](const WarmUpJob& job) {
+            return job.font_id == font_size.font_id && job.atlas_size == atlas_size;
+        });
+        if (atlas_size == 0 || queued || ctx->fonts[font_size.font_id].atlas_slots[atlas_size] != CLAY_ATLAS_NONE)
+        {
+            continue;
+        }
+
+        FontFace* font = font_library_open(&ctx->font_library, ctx->fonts[font_size.font_id].filepath);
+        if (!font)
+        {
+            store_atlas(ctx, font_size.font_id, atlas_size, nullptr, false);
+            continue;
+        }
+        jobs.push_back({ font_size.font_id, atlas_size, font, std::make_unique<CharacterAtlas>(), false });
+    }
+
+    if (jobs.empty())
+    {
+        return;
+    }
+
+    GLint gl_max_texture_size;
+    glGetIntegerv(GL_MAX_TEXTURE_SIZE, &gl_max_texture_size);
+
+    // FreeType objects are not thread safe, every worker opens its own library and faces over the shared file mappings
+    std::atomic<uint32_t> next_job = 0;
+    auto worker = [&]()
+    {
+        FontLibrary library;
+        if (font_library_init(&library))
+        {
+            return;
+        }
+
+        std::unordered_map<const FontFace*, FT_Face> faces;
+        for (uint32_t i = next_job++; i < jobs.size(); i = next_job++)
+        {
+            WarmUpJob& job = jobs[i];
+            std::string baked_filepath;
+            uint64_t key;
+            if (baked_atlas_location(ctx, job.font, job.atlas_size, &baked_filepath, &key) && load_baked_atlas(job.atlas.get(), baked_filepath, key) == 0)
+            {
+                job.built = true;
+                continue;
+            }
+
+            FT_Face& face = faces[job.font];
+            if (!face && open_font_face(library.ft, job.font, &face))
+            {
+                face = nullptr;
+                continue;
+            }
+            job.built = build_character_atlas(job.atlas.get(), face, job.atlas_size, ctx->sdf_text, static_cast<uint32_t>(gl_max_texture_size)) == 0;
+            if (job.built && !baked_filepath.empty())
+            {
+                save_baked_atlas(job.atlas.get(), baked_filepath, key);
+            }
+        }
+
+        // Also frees the faces and sizes opened above
+        font_library_destroy(&library);
+    };
+
+    uint32_t thread_count = std::min<uint32_t>(jobs.size(), std::max(1u, std::thread::hardware_concurrency()));
+    std::vector<std::thread> threads;
+    for (uint32_t i = 1; i < thread_count; i++)
+    {
+        threads.emplace_back(worker);
+    }
+    worker();
+    for (auto& thread : threads)
+    {
+        thread.join();
+    }
+
+    // Only the uploads need the context
+    for (auto& job : jobs)
+    {
+        bool built = job.built && finish_character_atlas(job.atlas.get(), job.font) == 0;
+        store_atlas(ctx, job.font_id, job.atlas_size, std::move(job.atlas), built);
+    }
+
+    // Creation binds the new textures behind ClayGLState
+    gl_state_reset(&ctx->gl);
 }
 
-void add_quad(ClayRenderCtx* ctx, glm::vec4 color, Quad quad, Rect bb)
+// Pen advance in pixels at the drawn size. Hinted atlases keep whole pixel advances at their own size
+float glyph_advance(const CharacterAtlas* atlas, const Character& ch, float scale)
 {
-    add_rect_vertex(ctx, quad.v0, color, bb);
-    add_rect_vertex(ctx, quad.v1, color, bb);
-    add_rect_vertex(ctx, quad.v2, color, bb);
+    return atlas->sdf ? ch.advance / 64.0f * scale : (float)(ch.advance >> 6) * scale;
+}
 
-    add_rect_vertex(ctx, quad.v0, color, bb);
-    add_rect_vertex(ctx, quad.v2, color, bb);
-    add_rect_vertex(ctx, quad.v3, color, bb);
+// RGBA8 in memory order, unpacked back to 0-1 in ui.vert
+uint32_t pack_clay_color(Clay_Color color)
+{
+    auto channel = [](float value) {
+        return static_cast<uint32_t>(std::clamp(value, 0.0f, 255.0f) + 0.5f);
+    };
+    return channel(color.r) | (channel(color.g) << 8) | (channel(color.b) << 16) | (channel(color.a) << 24);
 }
 
-void add_corner(ClayRenderCtx* ctx, glm::vec2 pos, glm::vec4 color, uint32_t radius, float start, float end, Rect bb)
+void flush_batch(ClayRenderCtx* ctx)
 {
-    if (radius == 0) return;
+    if (ctx->batch.count == 0)
+    {
+        return;
+    }
 
-    const int segments = 16;
-    float angle_step = (end - start) / static_cast<float>(segments);
+    stream_buffer_commit(&ctx->quad_stream);
 
-    glm::vec2 prev_pos = pos + static_cast<float>(radius) * glm::vec2(std::cos(start), std::sin(start));
+    reserve_quad_indices(ctx, ctx->batch.count);
+    gl_bind_vertex_array(&ctx->gl, ctx->quad_VAO);
 
-    for (int i = 1; i <= segments; ++i) 
+    gl_bind_texture(&ctx->gl, 2, GL_TEXTURE_BUFFER, ctx->quad_texture);
+    if (ctx->quad_texture_generation != ctx->quad_stream.generation)
     {
-        float angle = start + static_cast<float>(i) * angle_step;
-        glm::vec2 curr_pos = pos + static_cast<float>(radius) * glm::vec2(std::cos(angle), std::sin(angle));
+        // The stream buffer is replaced when it grows, compared by generation since the new one may reuse the name
+        gl_active_texture(&ctx->gl, 2);
+        glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32UI, ctx->quad_stream.buffer);
+        ctx->quad_texture_generation = ctx->quad_stream.generation;
+    }
 
-        add_rect_vertex(ctx, pos, color, bb);
-        add_rect_vertex(ctx, prev_pos, color, bb);
-        add_rect_vertex(ctx, curr_pos, color, bb);
+    gl_use_program(&ctx->gl, ctx->quad_shader);
+    if (!ctx->projection_uploaded || ctx->uploaded_projection != ctx->projection)
+    {
+        glUniformMatrix4fv(ctx->projection_location, 1, GL_FALSE, glm::value_ptr(ctx->projection));
+        ctx->uploaded_projection = ctx->projection;
+        ctx->projection_uploaded = true;
+        ctx->gl.calls++;
+    }
+    else
+    {
+        ctx->gl.elided++;
+    }
+    if (ctx->uploaded_glyph_mode != ctx->batch.glyph_mode)
+    {
+        glUniform1ui(ctx->glyph_mode_location, ctx->batch.glyph_mode);
+        ctx->uploaded_glyph_mode = ctx->batch.glyph_mode;
+        ctx->gl.calls++;
+    }
+    else
+    {
+        ctx->gl.elided++;
+    }
 
-        prev_pos = curr_pos;
+    // Slots nobody in the batch samples keep whatever was bound before
+    if (ctx->batch.texture_id != 0)
+    {
+        gl_bind_texture(&ctx->gl, 0, GL_TEXTURE_2D, ctx->batch.texture_id);
+    }
+    if (ctx->batch.atlas_id != 0)
+    {
+        gl_bind_texture(&ctx->gl, 1, GL_TEXTURE_2D, ctx->batch.atlas_id);
     }
+    if (ctx->batch.glyph_mode != 0)
+    {
+        gl_bind_texture(&ctx->gl, 3, GL_TEXTURE_BUFFER, ctx->batch.metrics_id);
+    }
+
+    // gl_VertexID includes the base vertex, so it indexes the whole stream buffer
+    uint32_t record_size = ctx->batch.glyph_mode != 0 ? sizeof(ClayGlyphInstance) : ctx->quad_record_size;
+    GLint base_vertex = static_cast<GLint>(ctx->batch.first / record_size * 4);
+    glDrawElementsBaseVertex(GL_TRIANGLES, ctx->batch.count * 6, GL_UNSIGNED_INT, nullptr, base_vertex);
+    checkOpenGLErrors("Quad batch draw");
+
+    ctx->stats.batches++;
+    ctx->batch.count = 0;
 }
 
-void add_arc(ClayRenderCtx* ctx, Arc arc)
+void encode_compact_quad(ClayCompactQuad* out, const ClayQuad& quad)
 {
-    const int segments = 16;
-    float angle_step = (arc.end - arc.start) / static_cast<float>(segments);
-    float width_step = (arc.width_end - arc.width_start) / static_cast<float>(segments);
+    auto unorm16 = [](float value) {
+        return static_cast<uint16_t>(std::clamp(value, 0.0f, 1.0f) * 65535.0f + 0.5f);
+    };
+    auto quarter_pixels = [](float value) {
+        return static_cast<uint16_t>(std::clamp(value * 4.0f + 0.5f, 0.0f, 65535.0f));
+    };
+    auto pixels = [](float value) {
+        return static_cast<uint16_t>(std::clamp(value + 0.5f, 0.0f, 65535.0f));
+    };
+
+    // Built on the stack and copied once, out may point into write-only mapped memory
+    ClayCompactQuad compact;
+    compact.bounds = quad.bounds;
+    compact.uv[0] = unorm16(quad.uv.x);
+    compact.uv[1] = unorm16(quad.uv.y);
+    compact.uv[2] = unorm16(quad.uv.z);
+    compact.uv[3] = unorm16(quad.uv.w);
+    compact.color = quad.color;
+    compact.mode = quad.mode;
+    compact.corner_radius[0] = quarter_pixels(quad.corner_radius.x);
+    compact.corner_radius[1] = quarter_pixels(quad.corner_radius.y);
+    compact.corner_radius[2] = quarter_pixels(quad.corner_radius.z);
+    compact.corner_radius[3] = quarter_pixels(quad.corner_radius.w);
+    compact.border_width[0] = pixels(quad.border_width.x);
+    compact.border_width[1] = pixels(quad.border_width.y);
+    compact.border_width[2] = pixels(quad.border_width.z);
+    compact.border_width[3] = pixels(quad.border_width.w);
+    *out = compact;
+}
 
-    glm::vec2 prev_inner = arc.pos + arc.radius * glm::vec2(std::cos(arc.start), std::sin(arc.start));
-    float curr_width = arc.width_start;
-    glm::vec2 prev_outer = arc.pos + (arc.radius + curr_width) * glm::vec2(std::cos(arc.start), std::sin(arc.start));
+// Room for one record of the current batch, which starts on a multiple of size so ui.vert can index it
+static void* alloc_batch_record(ClayRenderCtx* ctx, uint32_t size)
+{
+    if (ctx->batch.count == 0)
+    {
+        stream_buffer_align(&ctx->quad_stream, size);
+    }
 
-    Rect dummy_bb = {0.0f, 1.0f, 0.0f, 1.0f};
+    uint32_t offset;
+    void* ptr = stream_buffer_alloc(&ctx->quad_stream, size, &offset);
+    if (!ptr)
+    {
+        // Out of room for this frame, draw what we have and continue in a bigger buffer
+        flush_batch(ctx);
+        stream_buffer_grow(&ctx->quad_stream, size);
+        ptr = stream_buffer_alloc(&ctx->quad_stream, size, &offset);
+    }
 
-    for (int i = 1; i <= segments; ++i) 
+    if (ctx->batch.count == 0)
     {
-        float angle = arc.start + static_cast<float>(i) * angle_step;
-        curr_width = arc.width_start + static_cast<float>(i) * width_step;
-        glm::vec2 curr_inner = arc.pos + arc.radius * glm::vec2(std::cos(angle), std::sin(angle));
-        glm::vec2 curr_outer = arc.pos + (arc.radius + curr_width) * glm::vec2(std::cos(angle), std::sin(angle));
+        ctx->batch.first = offset;
+    }
+    ctx->batch.count++;
+    return ptr;
+}
 
-        add_rect_vertex(ctx, prev_inner, arc.color, dummy_bb);
-        add_rect_vertex(ctx, prev_outer, arc.color, dummy_bb);
-        add_rect_vertex(ctx, curr_inner, arc.color, dummy_bb);
+void push_quad(ClayRenderCtx* ctx, const ClayQuad& quad)
+{
+    if (ctx->batch.glyph_mode != 0)
+    {
+        flush_batch(ctx);
+        ctx->batch.glyph_mode = 0;
+    }
+    void* ptr = alloc_batch_record(ctx, ctx->quad_record_size);
 
-        add_rect_vertex(ctx, curr_inner, arc.color, dummy_bb);
-        add_rect_vertex(ctx, prev_outer, arc.color, dummy_bb);
-        add_rect_vertex(ctx, curr_outer, arc.color, dummy_bb);
+    if (ctx->compact_quads)
+    {
+        encode_compact_quad(static_cast<ClayCompactQuad*>(ptr), quad);
+    }
+    else
+    {
+        *static_cast<ClayQuad*>(ptr) = quad;
+    }
+}
 
-        prev_inner = curr_inner;
-        prev_outer = curr_outer;
+void push_glyph_instance(ClayRenderCtx* ctx, const CharacterAtlas* atlas, uint32_t page, const ClayGlyphInstance& instance)
+{
+    uint32_t glyph_mode = atlas->sdf ? CLAY_QUAD_SDF : CLAY_QUAD_GLYPH;
+    if (ctx->batch.glyph_mode != glyph_mode || ctx->batch.metrics_id != atlas->metrics_texture)
+    {
+        flush_batch(ctx);
+        ctx->batch.glyph_mode = glyph_mode;
+        ctx->batch.metrics_id = atlas->metrics_texture;
     }
+    set_batch_state(ctx, 0, atlas->pages[page].texture_id);
+
+    *static_cast<ClayGlyphInstance*>(alloc_batch_record(ctx, sizeof(ClayGlyphInstance))) = instance;
 }
 
+void set_batch_state(ClayRenderCtx* ctx, uint32_t texture_id, uint32_t atlas_id)
+{
+    bool texture_conflict = texture_id != 0 && ctx->batch.texture_id != 0 && texture_id != ctx->batch.texture_id;
+    bool atlas_conflict = atlas_id != 0 && ctx->batch.atlas_id != 0 && atlas_id != ctx->batch.atlas_id;
+    if (texture_conflict || atlas_conflict)
+    {
+        flush_batch(ctx);
+        ctx->batch.texture_id = 0;
+        ctx->batch.atlas_id = 0;
+    }
+
+    if (texture_id != 0)
+    {
+        ctx->batch.texture_id = texture_id;
+    }
+    if (atlas_id != 0)
+    {
+        ctx->batch.atlas_id = atlas_id;
+    }
+}
 
 void draw_clay_rectangle(ClayRenderCtx* ctx, Clay_RenderCommand command)
 {  
-    glm::vec4 color;
+    uint32_t color;
     Clay_CornerRadius cr;
     uint32_t texture_id;
+    ClayQuadMode mode;
     if (command.commandType == CLAY_RENDER_COMMAND_TYPE_IMAGE) 
     {
-        color = normalize_clay_color(command.renderData.image.backgroundColor);
+        color = pack_clay_color(command.renderData.image.backgroundColor);
         cr = command.renderData.image.cornerRadius;
-        texture_id = ctx->texture_ids[(char*)command.renderData.image.imageData];
+        uintptr_t handle = reinterpret_cast<uintptr_t>(command.renderData.image.imageData);
+        if (handle > 0 && handle <= ctx->image_textures.size())
+        {
+            texture_id = ctx->image_textures[handle - 1];
+            mode = CLAY_QUAD_IMAGE;
+        }
+        else
+        {
+            // Unknown handle, draw the background color only
+            texture_id = 0;
+            mode = CLAY_QUAD_SOLID;
+        }
     }
     else
     {
-        color = normalize_clay_color(command.renderData.rectangle.backgroundColor);
+        color = pack_clay_color(command.renderData.rectangle.backgroundColor);
         cr = command.renderData.rectangle.cornerRadius;
-        texture_id = ctx->texture_ids["white"];
+        texture_id = 0;
+        mode = CLAY_QUAD_SOLID;
     }
-    
-    Rect bb = { 
-        command.boundingBox.x, 
-        command.boundingBox.x + command.boundingBox.width, 
-        command.boundingBox.y, 
-        command.boundingBox.y + command.boundingBox.height,
+    set_batch_state(ctx, texture_id, 0);
+
+    // The SDF assumes a corner never reaches past the middle of an edge
+    float max_radius = 0.5f * std::min(command.boundingBox.width, command.boundingBox.height);
+
+    ClayQuad quad;
+    quad.bounds = { command.boundingBox.x, command.boundingBox.y, command.boundingBox.width, command.boundingBox.height };
+    quad.corner_radius = {
+        std::clamp(cr.topLeft, 0.0f, max_radius),
+        std::clamp(cr.topRight, 0.0f, max_radius),
+        std::clamp(cr.bottomRight, 0.0f, max_radius),
+        std::clamp(cr.bottomLeft, 0.0f, max_radius),
     };
-
-    // V0 - V3
-    // |    |
-    // V1 - V2
-
-    Quad top;
-    top.v0 = { bb.left + cr.topLeft, bb.top };
-    top.v1 = { bb.left + cr.topLeft, bb.top + cr.topLeft };
-    top.v2 = { bb.right - cr.topRight, bb.top + cr.topRight };
-    top.v3 = { bb.right - cr.topRight, bb.top };
-    add_quad(ctx, color, top, bb);
-
-    Quad center;
-    center.v0 = { bb.left + cr.topLeft, bb.top + cr.topLeft };
-    center.v1 = { bb.left + cr.bottomLeft, bb.bot - cr.bottomLeft };
-    center.v2 = { bb.right - cr.bottomRight, bb.bot - cr.bottomRight };
-    center.v3 = { bb.right - cr.topRight, bb.top + cr.topRight };
-    add_quad(ctx, color, center, bb);
-
-    Quad bot;
-    bot.v0 = { bb.left + cr.bottomLeft, bb.bot - cr.bottomLeft };
-    bot.v1 = { bb.left + cr.bottomLeft, bb.bot };
-    bot.v2 = { bb.right - cr.bottomRight, bb.bot };
-    bot.v3 = { bb.right - cr.bottomRight, bb.bot - cr.bottomRight };
-    add_quad(ctx, color, bot, bb);
-
-    Quad left;
-    left.v0 = { bb.left, bb.top + cr.topLeft };
-    left.v1 = { bb.left, bb.bot - cr.bottomLeft };
-    left.v2 = { bb.left + cr.bottomLeft, bb.bot - cr.bottomLeft };
-    left.v3 = { bb.left + cr.topLeft, bb.top + cr.topLeft };
-    add_quad(ctx, color, left, bb);
-    
-    Quad right;
-    right.v0 = { bb.right - cr.topRight, bb.top + cr.topRight };
-    right.v1 = { bb.right - cr.bottomRight, bb.bot - cr.bottomRight };
-    right.v2 = { bb.right, bb.bot - cr.bottomRight };
-    right.v3 = { bb.right, bb.top + cr.topRight };
-    add_quad(ctx, color, right, bb);
-
-    // Top left corner
-    glm::vec2 corner_pos = { bb.left + cr.topLeft, bb.top + cr.topLeft };
-    add_corner(ctx, corner_pos, color, cr.topLeft, PI, 3.0f * PI / 2.0f, bb);
-
-    // Bottom left corner
-    corner_pos = { bb.left + cr.bottomLeft, bb.bot - cr.bottomLeft };
-    add_corner(ctx, corner_pos, color, cr.bottomLeft, PI / 2.0f, PI, bb);
-
-    // Bottom right corner
-    corner_pos = { bb.right - cr.bottomRight, bb.bot - cr.bottomRight };
-    add_corner(ctx, corner_pos, color, cr.bottomRight, 0.0f, PI / 2.0f, bb);
-
-    // Top right corner
-    corner_pos = { bb.right - cr.topRight, bb.top + cr.topRight };
-    add_corner(ctx, corner_pos, color, cr.topRight, 3.0f * PI / 2.0f, 2.0f * PI, bb);
-
-    glEnable(GL_BLEND); 
-    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-
-    glBindVertexArray(ctx->rect_VAO);
-    glBindBuffer(GL_ARRAY_BUFFER, ctx->rect_VBO);
-    glBufferData(GL_ARRAY_BUFFER, ctx->rect_vertices.size() * sizeof(ClayRectVertex), ctx->rect_vertices.data(), GL_STREAM_DRAW);
-    
-    glUseProgram(ctx->rect_shader);
-    glUniformMatrix4fv(glGetUniformLocation(ctx->rect_shader, "projection"), 1, GL_FALSE, glm::value_ptr(ctx->projection));
-    glUniform1i(glGetUniformLocation(ctx->rect_shader, "tex_sampler"), 0);
-    
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, texture_id);
-    
-    glDrawArrays(GL_TRIANGLES, 0, ctx->rect_vertices.size());
-    
-    checkOpenGLErrors("Rectangle draw");
+    quad.color = color;
+    quad.uv = { 0.0f, 0.0f, 1.0f, 1.0f };
+    quad.border_width = { 0.0f, 0.0f, 0.0f, 0.0f };
+    quad.mode = mode;
+    push_quad(ctx, quad);
 }
 
 void draw_clay_border(ClayRenderCtx* ctx, Clay_RenderCommand command)
 {
-    glm::vec4 color = normalize_clay_color(command.renderData.border.color);
     Clay_CornerRadius cr = command.renderData.border.cornerRadius;
     Clay_BorderWidth bw = command.renderData.border.width;
-    uint32_t texture_id = ctx->texture_ids["white"];
-    
-    Rect bb = { 
-        command.boundingBox.x, 
-        command.boundingBox.x + command.boundingBox.width, 
-        command.boundingBox.y, 
-        command.boundingBox.y + command.boundingBox.height,
+    if (bw.left == 0 && bw.right == 0 && bw.top == 0 && bw.bottom == 0)
+    {
+        return;
+    }
+
+    // The border is drawn outside the bounding box, so the outer corners grow by the side widths
+    auto outer_radius = [](float radius, uint16_t width_a, uint16_t width_b) {
+        return radius > 0.0f ? radius + std::max(width_a, width_b) : 0.0f;
     };
 
-    Rect dummy_bb = {0.f, 1.f, 0.f, 1.f};  // Dummy to avoid div-zero in UV calc; fine for white texture
-
-    // Left
-    Quad left;
-    left.v0 = { bb.left - bw.left, bb.top + cr.topLeft };
-    left.v1 = { bb.left - bw.left, bb.bot - cr.bottomLeft };
-    left.v2 = { bb.left, bb.bot - cr.bottomLeft };
-    left.v3 = { bb.left, bb.top + cr.topLeft };
-    add_quad(ctx, color, left, dummy_bb);
-
-    // Right
-    Quad right;
-    right.v0 = { bb.right + bw.right, bb.top + cr.topRight };
-    right.v1 = { bb.right + bw.right, bb.bot - cr.bottomRight };
-    right.v2 = { bb.right, bb.bot - cr.bottomRight };
-    right.v3 = { bb.right, bb.top + cr.topRight };
-    add_quad(ctx, color, right, dummy_bb);
-
-    // Top
-    Quad top;
-    top.v0 = { bb.left + cr.topLeft, bb.top - bw.top };
-    top.v1 = { bb.left + cr.topLeft, bb.top };
-    top.v2 = { bb.right - cr.topRight, bb.top };
-    top.v3 = { bb.right - cr.topRight, bb.top - bw.top };
-    add_quad(ctx, color, top, dummy_bb);
-
-    // Bottom
-    Quad bot;
-    bot.v0 = { bb.left + cr.bottomLeft, bb.bot + bw.bottom };
-    bot.v1 = { bb.left + cr.bottomLeft, bb.bot };
-    bot.v2 = { bb.right - cr.bottomRight, bb.bot };
-    bot.v3 = { bb.right - cr.bottomRight, bb.bot + bw.bottom };
-    add_quad(ctx, color, bot, dummy_bb);
-
-    // Top left
-    Arc top_left;
-    top_left.pos = { bb.left + cr.topLeft, bb.top + cr.topLeft };
-    top_left.radius = cr.topLeft;
-    top_left.width_start = bw.left;
-    top_left.width_end   = bw.top;
-    top_left.color = color;
-    top_left.start = PI;
-    top_left.end   = 3.0f * PI / 2.0f;
-    add_arc(ctx, top_left);
-
-    // Bottom left
-    Arc bottom_left;
-    bottom_left.pos = { bb.left + cr.bottomLeft, bb.bot  - cr.bottomLeft };
-    bottom_left.radius = cr.bottomLeft;
-    bottom_left.width_start = bw.bottom;
-    bottom_left.width_end   = bw.left;
-    bottom_left.color = color;
-    bottom_left.start = PI / 2.0f;
-    bottom_left.end   = PI;
-    add_arc(ctx, bottom_left);
-
-    // Bottom right
-    Arc bottom_right;
-    bottom_right.pos = { bb.right - cr.bottomRight, bb.bot  - cr.bottomRight };
-    bottom_right.radius = cr.bottomRight;
-    bottom_right.width_start = bw.right;
-    bottom_right.width_end   = bw.bottom;
-    bottom_right.color = color;
-    bottom_right.start = 0.0f;
-    bottom_right.end   = PI / 2.0f;
-    add_arc(ctx, bottom_right);
-
-    // Top right
-    Arc top_right;
-    top_right.pos = { bb.right - cr.topRight,    bb.top + cr.topRight };
-    top_right.radius = cr.topRight;
-    top_right.width_start = bw.top;
-    top_right.width_end   = bw.right;
-    top_right.color = color;
-    top_right.start = 3.0f * PI / 2.0f;
-    top_right.end   = 2.0f * PI;
-    add_arc(ctx, top_right);
-
-    glEnable(GL_BLEND); 
-    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    float width = command.boundingBox.width + bw.left + bw.right;
+    float height = command.boundingBox.height + bw.top + bw.bottom;
+    float max_radius = 0.5f * std::min(width, height);
+
+    ClayQuad quad;
+    quad.bounds = { command.boundingBox.x - bw.left, command.boundingBox.y - bw.top, width, height };
+    quad.corner_radius = {
+        std::min(outer_radius(cr.topLeft, bw.left, bw.top), max_radius),
+        std::min(outer_radius(cr.topRight, bw.right, bw.top), max_radius),
+        std::min(outer_radius(cr.bottomRight, bw.right, bw.bottom), max_radius),
+        std::min(outer_radius(cr.bottomLeft, bw.left, bw.bottom), max_radius),
+    };
+    quad.color = pack_clay_color(command.renderData.border.color);
+    quad.uv = { 0.0f, 0.0f, 1.0f, 1.0f };
+    quad.border_width = { (float)bw.left, (float)bw.right, (float)bw.top, (float)bw.bottom };
+    quad.mode = CLAY_QUAD_SOLID;
+    push_quad(ctx, quad);
+}
+
+// Lays the glyphs out from a pen origin on the baseline
+static void build_text_run(ClayRenderCtx* ctx, ClayTextRun* run, Clay_StringSlice text, CharacterAtlas* atlas, float scale)
+{
+    run->quads.clear();
+    run->dynamic_codepoints.clear();
+    run->complete = true;
+
+    // Reused across commands, only grows
+    if (ctx->codepoints.size() < static_cast<size_t>(text.length))
+    {
+        ctx->codepoints.resize(text.length);
+    }
+    size_t codepoint_count = decode_utf8(text.chars, text.length, ctx->codepoints.data());
+    const uint32_t* codepoints = ctx->codepoints.data();
+
+    // Kerned and spaced the same way as MeasureText, so the run fills exactly the width Clay wrapped it to
+    float x = 0.0f;
+    float gap = 0.0f; // Letter spacing, only between glyphs
+    uint32_t previous = CLAY_INVALID_CODEPOINT;
+    for (size_t i = 0; i < codepoint_count; i++)
+    {
+        uint32_t glyph_index;
+        const Character* glyph = get_character(atlas, codepoints[i], ctx->frame, &glyph_index);
+        if (!glyph)
+        {
+            run->complete = false;
+            continue;
+        }
+        x += glyph_kerning(atlas, previous, codepoints[i]) * scale + gap;
+        previous = codepoints[i];
+        gap = static_cast<float>(run->letter_spacing);
+        Character ch = *glyph;
+        if (codepoints[i] >= CLAY_GLYPH_PINNED_CODEPOINTS)
+        {
+            run->dynamic_codepoints.push_back(codepoints[i]);
+        }
+
+        float xpos = x + ch.bearing.x * scale;
+        float ypos = (ch.size.y - ch.bearing.y) * scale;
 
-    glBindVertexArray(ctx->rect_VAO);
-    glBindBuffer(GL_ARRAY_BUFFER, ctx->rect_VBO);
-    glBufferData(GL_ARRAY_BUFFER, ctx->rect_vertices.size() * sizeof(ClayRectVertex), ctx->rect_vertices.data(), GL_STREAM_DRAW);
-    
-    glUseProgram(ctx->rect_shader);
-    glUniformMatrix4fv(glGetUniformLocation(ctx->rect_shader, "projection"), 1, GL_FALSE, glm::value_ptr(ctx->projection));
-    glUniform1i(glGetUniformLocation(ctx->rect_shader, "tex_sampler"), 0);
-    
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, texture_id);
-    
-    glDrawArrays(GL_TRIANGLES, 0, ctx->rect_vertices.size());
-    
-    checkOpenGLErrors("Border draw");
+        float w = ch.size.x * scale;
+        float h = ch.size.y * scale;
+
+        if (w > 0.0f && h > 0.0f)
+        {
+            ClayGlyphQuad quad;
+            quad.bounds = { xpos, ypos - h, w, h };
+            quad.uv = { ch.bounds.left, ch.bounds.top, ch.bounds.right, ch.bounds.bot };
+            quad.pen_x = x;
+            quad.glyph_index = glyph_index;
+            quad.page = ch.page;
+            run->quads.push_back(quad);
+        }
+
+        x += glyph_advance(atlas, ch, scale);
+    }
+
+    run->atlas = atlas;
+    run->evictions = atlas->cache_stats.evictions;
+}
+
+const ClayTextRun* get_text_run(ClayRenderCtx* ctx, Clay_StringSlice text, uint16_t font_id, uint16_t font_size, uint16_t letter_spacing, CharacterAtlas* atlas, float scale)
+{
+    uint16_t params[] = { font_id, font_size, letter_spacing };
+    uint64_t key = hash_bytes(params, sizeof(params), hash_bytes(text.chars, text.length));
+
+    ClayTextRun& run = ctx->text_runs[key];
+    bool same_text = run.text.size() == static_cast<size_t>(text.length)
+        && memcmp(run.text.data(), text.chars, text.length) == 0
+        && run.font_id == font_id
+        && run.font_size == font_size
+        && run.letter_spacing == letter_spacing;
+
+    // Evictions may have moved dynamic glyphs, pinned ASCII never moves
+    bool valid = ctx->text_run_cache
+        && same_text
+        && run.complete
+        && run.atlas == atlas
+        && (run.dynamic_codepoints.empty() || run.evictions == atlas->cache_stats.evictions);
+    if (valid)
+    {
+        // Stamp the dynamic glyphs so nothing drawn later this frame evicts them
+        for (uint32_t codepoint : run.dynamic_codepoints)
+        {
+            get_character(atlas, codepoint, ctx->frame);
+        }
+        run.last_used = ctx->frame;
+        ctx->stats.text_run_hits++;
+        return &run;
+    }
+
+    if (!same_text)
+    {
+        run.text.assign(text.chars, text.length);
+        run.font_id = font_id;
+        run.font_size = font_size;
+        run.letter_spacing = letter_spacing;
+    }
+    build_text_run(ctx, &run, text, atlas, scale);
+    run.last_used = ctx->frame;
+    ctx->stats.text_run_misses++;
+    return &run;
+}
+
+static bool outside_clip(const Rect& clip, float x, float y, float width, float height)
+{
+    return x >= clip.right || x + width <= clip.left || y >= clip.bot || y + height <= clip.top;
+}
+
+// Lays a numeric label out with atlas->numeric_advances, each glyph centered in its advance. Only pinned ASCII
+// is drawn, which never moves in the atlas, so nothing needs to be cached or revalidated
+static void build_numeric_quads(ClayRenderCtx* ctx, Clay_StringSlice text, const CharacterAtlas* atlas, float scale, uint16_t letter_spacing)
+{
+    ctx->numeric_quads.clear();
+
+    float x = 0.0f;
+    float gap = 0.0f;
+    for (int32_t i = 0; i < text.length; i++)
+    {
+        unsigned char byte = static_cast<unsigned char>(text.chars[i]);
+        if (byte >= CLAY_GLYPH_PINNED_CODEPOINTS)
+        {
+            continue;
+        }
+        x += gap;
+        gap = static_cast<float>(letter_spacing);
+
+        float cell = atlas->numeric_advances[byte] * scale;
+        float pen_x = x + (cell - atlas->ascii_metrics[byte].advance * scale) * 0.5f;
+        x += cell;
+
+        const Character& ch = atlas->characters[byte];
+        float w = ch.size.x * scale;
+        float h = ch.size.y * scale;
+        if (w <= 0.0f || h <= 0.0f)
+        {
+            continue;
+        }
+
+        ClayGlyphQuad quad;
+        quad.bounds = { pen_x + ch.bearing.x * scale, -ch.bearing.y * scale, w, h };
+        quad.uv = { ch.bounds.left, ch.bounds.top, ch.bounds.right, ch.bounds.bot };
+        quad.pen_x = pen_x;
+        quad.glyph_index = byte;
+        quad.page = 0;
+        ctx->numeric_quads.push_back(quad);
+    }
 }
 
 void draw_clay_text(ClayRenderCtx* ctx, Clay_RenderCommand command)
 {
     uint16_t font_id = command.renderData.text.fontId;
     uint16_t font_size = command.renderData.text.fontSize;
-    glm::vec4 color = normalize_clay_color(command.renderData.text.textColor);
-    std::string text(command.renderData.text.stringContents.chars, command.renderData.text.stringContents.length);
+    uint32_t color = pack_clay_color(command.renderData.text.textColor);
+    Clay_StringSlice text = command.renderData.text.stringContents;
 
-    CharacterAtlas* atlas = &ctx->character_atlases[ctx->fonts[font_id]][font_size];
+    float scale;
+    CharacterAtlas* atlas = find_character_atlas(ctx, font_id, font_size, &scale);
+    if (!atlas)
+    {
+        return;
+    }
+    ClayQuadMode mode = atlas->sdf ? CLAY_QUAD_SDF : CLAY_QUAD_GLYPH;
 
     Rect bb = { 
         command.boundingBox.x, 
@@ -483,11 +896,8 @@ void draw_clay_text(ClayRenderCtx* ctx, Clay_RenderCommand command)
         command.boundingBox.y + command.boundingBox.height,
     };
 
-    std::vector<uint32_t> codepoints;
-    utf8_to_codepoints(text, codepoints);
-
-    float ascender = atlas->ascender;
-    float descender = atlas->descender;
+    float ascender = atlas->ascender * scale;
+    float descender = atlas->descender * scale;
     if (ascender <= 0.0f && descender <= 0.0f)
     {
         ascender = static_cast<float>(font_size);
@@ -499,75 +909,91 @@ void draw_clay_text(ClayRenderCtx* ctx, Clay_RenderCommand command)
     float vertical_extra = std::max(0.0f, layout_height - text_height);
     float baseline = bb.top + vertical_extra * 0.5f + ascender;
 
-    float x = bb.left;
-    float y = baseline;
-    for (int i = 0; i < codepoints.size(); i++)
+    // Clay only culls against the window, lines scrolled out of a nested clip are dropped here before layout.
+    // Ink may poke past the ascender, descender and measured width, so the line test keeps a margin
+    const Rect& clip = ctx->clip_rect;
+    float margin = static_cast<float>(font_size);
+    if (outside_clip(clip, bb.left - margin, baseline - ascender - margin, bb.right - bb.left + 2.0f * margin, ascender + descender + 2.0f * margin))
     {
-        if (codepoints[i] >= atlas->characters.size()) continue;
-        Character ch = atlas->characters[codepoints[i]];
-
-        float xpos = x + ch.bearing.x;
-        float ypos = y + (ch.size.y - ch.bearing.y);
-
-        float w = ch.size.x;
-        float h = ch.size.y;
-
-        // Create vertices
-        CharacterVertex vertex;
-
-        // top left
-        vertex.pos = { xpos, ypos - h };
-        vertex.uv = { ch.bounds.left, ch.bounds.top };
-        ctx->text_vertices.push_back(vertex);
-
-        // bottom left
-        vertex.pos = { xpos, ypos };
-        vertex.uv = { ch.bounds.left, ch.bounds.bot };
-        ctx->text_vertices.push_back(vertex);
-
-        // bottom right
-        vertex.pos = { xpos + w, ypos };
-        vertex.uv = { ch.bounds.right, ch.bounds.bot };
-        ctx->text_vertices.push_back(vertex);
-
-        // top left
-        vertex.pos = { xpos, ypos - h };
-        vertex.uv = { ch.bounds.left, ch.bounds.top };
-        ctx->text_vertices.push_back(vertex);
-
-        // bottom right
-        vertex.pos = { xpos + w, ypos };
-        vertex.uv = { ch.bounds.right, ch.bounds.bot };
-        ctx->text_vertices.push_back(vertex);
+        ctx->stats.text_lines_culled++;
+        return;
+    }
 
-        // top right
-        vertex.pos = { xpos + w, ypos - h };
-        vertex.uv = { ch.bounds.right, ch.bounds.top };
-        ctx->text_vertices.push_back(vertex);
+    const std::vector<ClayGlyphQuad>* quads;
+    if (font_id & CLAY_NUMERIC_FONT)
+    {
+        build_numeric_quads(ctx, text, atlas, scale, command.renderData.text.letterSpacing);
+        quads = &ctx->numeric_quads;
+    }
+    else
+    {
+        quads = &get_text_run(ctx, text, font_id, font_size, command.renderData.text.letterSpacing, atlas, scale)->quads;
+    }
 
-        x += ch.advance >> 6;
+    // Pages added while laying out or measuring need their texture before a batch can claim them
+    if (grow_character_atlas(atlas))
+    {
+        gl_state_reset(&ctx->gl);
+    }
 
+    // Every page and metrics row is final once the quads are built, upload glyphs rasterized on first use before any
+    // of them is emitted, since a page switch or stream growth may flush in the middle of this command
+    for (uint32_t page = 0; page < atlas->pages.size(); page++)
+    {
+        if (atlas_page_dirty(&atlas->pages[page]))
+        {
+            // A cached binding skips glActiveTexture, and the upload writes to whichever unit is active
+            gl_bind_texture(&ctx->gl, 1, GL_TEXTURE_2D, atlas->pages[page].texture_id);
+            gl_active_texture(&ctx->gl, 1);
+            upload_atlas_page(atlas, page);
+        }
     }
-    glUseProgram(ctx->text_shader);
-    glUniformMatrix4fv(glGetUniformLocation(ctx->text_shader, "projection"), 1, GL_FALSE, glm::value_ptr(ctx->projection));
-    glUniform1i(glGetUniformLocation(ctx->text_shader, "character_atlas"), 0);
-    glUniform4fv(glGetUniformLocation(ctx->text_shader, "text_color"), 1, glm::value_ptr(color));
+    upload_instance_metrics(atlas);
 
-    glBindVertexArray(ctx->text_VAO);
-    glBindBuffer(GL_ARRAY_BUFFER, ctx->text_VBO);
-    glBufferData(GL_ARRAY_BUFFER, ctx->text_vertices.size() * sizeof(CharacterVertex), ctx->text_vertices.data(), GL_STREAM_DRAW);
-    
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, atlas->texture_id);  
-    
-    glDrawArrays(GL_TRIANGLES, 0, ctx->text_vertices.size());
-    
-    checkOpenGLErrors("Text draw");
+    if (ctx->glyph_instances && atlas->metrics_texture != 0)
+    {
+        // The vertex shader places each glyph from the atlas' metrics, only the pen position goes over the bus
+        uint32_t scale_bits = std::min(static_cast<uint32_t>(scale * CLAY_GLYPH_SCALE_ONE + 0.5f), 0xFFFFFFFFu >> CLAY_GLYPH_INDEX_BITS);
+        for (const auto& glyph : *quads)
+        {
+            if (outside_clip(clip, bb.left + glyph.bounds.x, baseline + glyph.bounds.y, glyph.bounds.z, glyph.bounds.w))
+            {
+                ctx->stats.glyphs_culled++;
+                continue;
+            }
+
+            ClayGlyphInstance instance;
+            instance.x = bb.left + glyph.pen_x;
+            instance.y = baseline;
+            instance.glyph = glyph.glyph_index | (scale_bits << CLAY_GLYPH_INDEX_BITS);
+            instance.color = color;
+            push_glyph_instance(ctx, atlas, glyph.page, instance);
+        }
+    }
+    else
+    {
+        for (const auto& glyph : *quads)
+        {
+            if (outside_clip(clip, bb.left + glyph.bounds.x, baseline + glyph.bounds.y, glyph.bounds.z, glyph.bounds.w))
+            {
+                ctx->stats.glyphs_culled++;
+                continue;
+            }
+
+            ClayQuad quad;
+            quad.bounds = { bb.left + glyph.bounds.x, baseline + glyph.bounds.y, glyph.bounds.z, glyph.bounds.w };
+            quad.corner_radius = { 0.0f, 0.0f, 0.0f, 0.0f };
+            quad.color = color;
+            quad.uv = glyph.uv;
+            quad.border_width = { 0.0f, 0.0f, 0.0f, 0.0f };
+            quad.mode = mode;
+            set_batch_state(ctx, 0, atlas->pages[glyph.page].texture_id);
+            push_quad(ctx, quad);
+        }
+    }
 }
 void draw_clay_text_debug(ClayRenderCtx* ctx, Clay_RenderCommand command)
 {
-    ctx->rect_vertices.clear();
-
     uint16_t font_id = command.renderData.text.fontId;
     uint16_t font_size = command.renderData.text.fontSize;
 
@@ -583,9 +1009,14 @@ void draw_clay_text_debug(ClayRenderCtx* ctx, Clay_RenderCommand command)
         return;
     }
 
-    CharacterAtlas* atlas = &ctx->character_atlases[ctx->fonts[font_id]][font_size];
+    float scale;
+    CharacterAtlas* atlas = find_character_atlas(ctx, font_id, font_size, &scale);
+    if (!atlas)
+    {
+        return;
+    }
 
-    glm::vec4 color = normalize_clay_color(command.renderData.text.textColor);
+    uint32_t color = pack_clay_color(command.renderData.text.textColor);
 
     Rect layout_bb = {
         command.boundingBox.x,
@@ -594,8 +1025,8 @@ void draw_clay_text_debug(ClayRenderCtx* ctx, Clay_RenderCommand command)
         command.boundingBox.y + command.boundingBox.height,
     };
 
-    float ascender = atlas->ascender;
-    float descender = atlas->descender;
+    float ascender = atlas->ascender * scale;
+    float descender = atlas->descender * scale;
     if (ascender <= 0.0f && descender <= 0.0f)
     {
         ascender = static_cast<float>(font_size);
@@ -612,30 +1043,14 @@ void draw_clay_text_debug(ClayRenderCtx* ctx, Clay_RenderCommand command)
 
     Rect bb = { layout_bb.left, layout_bb.left + dims.width, top, bottom };
 
-    Quad quad;
-    quad.v0 = { bb.left, bb.top };
-    quad.v1 = { bb.left, bb.bot };
-    quad.v2 = { bb.right, bb.bot };
-    quad.v3 = { bb.right, bb.top };
-    add_quad(ctx, color, quad, bb);
-
-    glEnable(GL_BLEND);
-    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-
-    glBindVertexArray(ctx->rect_VAO);
-    glBindBuffer(GL_ARRAY_BUFFER, ctx->rect_VBO);
-    glBufferData(GL_ARRAY_BUFFER, ctx->rect_vertices.size() * sizeof(ClayRectVertex), ctx->rect_vertices.data(), GL_STREAM_DRAW);
-
-    glUseProgram(ctx->rect_shader);
-    glUniformMatrix4fv(glGetUniformLocation(ctx->rect_shader, "projection"), 1, GL_FALSE, glm::value_ptr(ctx->projection));
-    glUniform1i(glGetUniformLocation(ctx->rect_shader, "tex_sampler"), 0);
-
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, ctx->texture_ids["white"]);
-
-    glDrawArrays(GL_TRIANGLES, 0, ctx->rect_vertices.size());
-
-    checkOpenGLErrors("Text debug draw");
+    ClayQuad quad;
+    quad.bounds = { bb.left, bb.top, bb.right - bb.left, bb.bot - bb.top };
+    quad.corner_radius = { 0.0f, 0.0f, 0.0f, 0.0f };
+    quad.color = color;
+    quad.uv = { 0.0f, 0.0f, 1.0f, 1.0f };
+    quad.border_width = { 0.0f, 0.0f, 0.0f, 0.0f };
+    quad.mode = CLAY_QUAD_SOLID;
+    push_quad(ctx, quad);
 }
 
 
@@ -643,27 +1058,45 @@ void clay_render(Clay_RenderCommandArray commands, ClayRenderCtx* ctx, int windo
 {
     ctx->projection = glm::ortho(0.0f, static_cast<float>(window_width), static_cast<float>(window_height), 0.0f);
 
+    ctx->frame++;
+    ctx->stats = {};
+
+    for (auto it = ctx->text_runs.begin(); it != ctx->text_runs.end();)
+    {
+        it = ctx->frame - it->second.last_used > ctx->text_run_max_age ? ctx->text_runs.erase(it) : std::next(it);
+    }
+    ctx->stats.commands = commands.length;
+    ctx->batch = {};
+
+    stream_buffer_begin_frame(&ctx->quad_stream);
+
+    gl_state_reset(&ctx->gl);
+    gl_set_blend(&ctx->gl, true);
+    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+
     std::stack<Rect> scissors;
     auto apply_scissor = [&](const Rect& r) {
+        // Geometry queued so far was clipped against the previous scissor
+        flush_batch(ctx);
+        ctx->clip_rect = r;
+        gl_set_scissor_test(&ctx->gl, true);
         if (r.right <= r.left || r.bot <= r.top) {
-            glDisable(GL_SCISSOR_TEST);
+            // Fully clipped, rects and images draw nothing just as text is culled against clip_rect
+            gl_scissor(&ctx->gl, 0, 0, 0, 0);
             return;
         }
-        glEnable(GL_SCISSOR_TEST);
         GLint x = static_cast<GLint>(r.left);
         GLint width = static_cast<GLint>(r.right - r.left);
         GLint height = static_cast<GLint>(r.bot - r.top);
         GLint y = static_cast<GLint>(window_height - (r.top + height));
-        glScissor(x, y, width, height);
+        gl_scissor(&ctx->gl, x, y, width, height);
     };
     scissors.push({ 0, (float)window_width, 0, (float)window_height });
-    glDisable(GL_SCISSOR_TEST);
+    gl_set_scissor_test(&ctx->gl, false);
+    ctx->clip_rect = scissors.top();
 
     for (int i = 0; i < commands.length; i++) 
     {
-        ctx->rect_vertices.clear();
-        ctx->text_vertices.clear();
-
         Clay_RenderCommand command = commands.internalArray[i];
         Rect bb = { 
             command.boundingBox.x, 
@@ -702,21 +1135,40 @@ void clay_render(Clay_RenderCommandArray commands, ClayRenderCtx* ctx, int windo
                     }
                     else
                     {
-                        glDisable(GL_SCISSOR_TEST);
+                        flush_batch(ctx);
+                        gl_set_scissor_test(&ctx->gl, false);
+                        ctx->clip_rect = scissors.top();
                     }
                 }
                 else
                 {
-                    glDisable(GL_SCISSOR_TEST);
+                    flush_batch(ctx);
+                    gl_set_scissor_test(&ctx->gl, false);
+                    ctx->clip_rect = scissors.top();
                 }
                 break;
         }
+
+        if (!ctx->batching)
+        {
+            flush_batch(ctx);
+        }
     }
+
+    flush_batch(ctx);
+
+    stream_buffer_end_frame(&ctx->quad_stream);
+
+    // Counted from here to the end of the next frame, so atlases built while Clay lays that frame out count toward it
+    ctx->stats.gl_calls = ctx->gl.calls;
+    ctx->stats.gl_calls_elided = ctx->gl.elided;
+    ctx->gl.calls = 0;
+    ctx->gl.elided = 0;
 }
 
 uint16_t get_font_id(ClayRenderCtx* ctx, std::string font)
 {
-    auto it = std::find(ctx->fonts.begin(), ctx->fonts.end(), font);
+    auto it = std::find_if(ctx->fonts.begin(), ctx->fonts.end(), [&](const ClayFont& entry) { return entry.filepath == font; });
     if (it != ctx->fonts.end())
     {   
         return std::distance(ctx->fonts.begin(), it);
@@ -736,98 +1188,93 @@ Clay_Dimensions MeasureText(Clay_StringSlice text, Clay_TextElementConfig* confi
     }
 
     ClayRenderCtx* ctx = static_cast<ClayRenderCtx*>(user_data);
-    if (config->fontId >= ctx->fonts.size())
+    float scale;
+    CharacterAtlas* found = find_character_atlas(ctx, config->fontId, config->fontSize, &scale);
+    if (!found)
     {
         return dims;
     }
+    CharacterAtlas& atlas = *found;
 
-    const std::string& font_path = ctx->fonts[config->fontId];
-    auto atlas_map_it = ctx->character_atlases.find(font_path);
-    if (atlas_map_it == ctx->character_atlases.end())
-    {
-        return dims;
-    }
-
-    auto atlas_it = atlas_map_it->second.find(config->fontSize);
-    if (atlas_it == atlas_map_it->second.end())
+    float line_height = atlas.line_height > 0.0f ? atlas.line_height * scale : static_cast<float>(config->fontSize);
+    if (line_height <= 0.0f)
     {
-        return dims;
+        line_height = static_cast<float>(config->fontSize);
     }
+    dims.height = line_height;
 
-    const CharacterAtlas& atlas = atlas_it->second;
-    if (atlas.characters.empty())
+    // Same advances as build_numeric_quads, no kerning or ink extents to track
+    if (config->fontId & CLAY_NUMERIC_FONT)
     {
+        float width = 0.0f;
+        int32_t placed = 0;
+        for (int32_t i = 0; i < text.length; i++)
+        {
+            unsigned char byte = static_cast<unsigned char>(text.chars[i]);
+            if (byte < CLAY_GLYPH_PINNED_CODEPOINTS)
+            {
+                width += atlas.numeric_advances[byte];
+                placed++;
+            }
+        }
+        dims.width = width * scale + std::max(placed - 1, 0) * config->letterSpacing;
         return dims;
     }
 
-    std::string string(text.chars, text.length);
-    std::vector<uint32_t> codepoints;
-    codepoints.reserve(string.size());
-    utf8_to_codepoints(string, codepoints);
-
+    // Measured in atlas pixels and scaled once at the end. Starting the extents at the pen origin gives
+    // the same width as tracking the first inked glyph, since advances never go backwards
     float pen_x = 0.0f;
-    float min_x = std::numeric_limits<float>::max();
-    float max_x = std::numeric_limits<float>::lowest();
-    bool has_geometry = false;
-
-    for (uint32_t codepoint : codepoints)
+    float min_x = 0.0f;
+    float max_x = 0.0f;
+    uint32_t previous = CLAY_INVALID_CODEPOINT;
+    float spacing = config->letterSpacing / scale; // Between glyphs, in atlas pixels like everything else here
+    float gap = 0.0f;
+
+    const char* chars = text.chars;
+    size_t length = static_cast<size_t>(text.length);
+    size_t i = 0;
+    while (i < length)
     {
-        if (codepoint >= atlas.characters.size())
+        unsigned char byte = static_cast<unsigned char>(chars[i]);
+        uint32_t codepoint = byte;
+        GlyphMetrics metrics;
+        if (byte < 0x80)
         {
-            continue;
+            metrics = atlas.ascii_metrics[byte];
+            i++;
+        }
+        else
+        {
+            codepoint = next_codepoint(chars, length, &i);
+            if (codepoint == CLAY_INVALID_CODEPOINT)
+            {
+                continue;
+            }
+
+            // Layout runs before the frame that draws it, stamp glyphs with that frame so drawing cannot evict them
+            const Character* glyph = get_character(&atlas, codepoint, ctx->frame + 1);
+            if (!glyph)
+            {
+                continue;
+            }
+            metrics = glyph_metrics(&atlas, *glyph);
         }
 
-        const Character& ch = atlas.characters[codepoint];
-
-        float xpos = pen_x + static_cast<float>(ch.bearing.x);
-        float w = static_cast<float>(ch.size.x);
-        float h = static_cast<float>(ch.size.y);
-
-        if (w > 0.0f || h > 0.0f)
+        // Same pairs and spacing as build_text_run, skipped glyphs do not break a pair there either
+        if (atlas.kerned)
         {
-            min_x = has_geometry ? std::min(min_x, xpos) : xpos;
-            max_x = has_geometry ? std::max(max_x, xpos + w) : xpos + w;
-            has_geometry = true;
+            pen_x += glyph_kerning(&atlas, previous, codepoint);
+            previous = codepoint;
         }
+        pen_x += gap;
+        gap = spacing;
 
-        pen_x += static_cast<float>(ch.advance >> 6);
+        min_x = std::min(min_x, pen_x + metrics.left);
+        max_x = std::max(max_x, pen_x + metrics.right);
+        pen_x += metrics.advance;
     }
 
-    if (has_geometry)
-    {
-        float left_extent = std::min(0.0f, min_x);
-        float right_extent = std::max(max_x, pen_x);
-        dims.width = right_extent - left_extent;
-    }
-    else
-    {
-        dims.width = pen_x;
-    }
-
-    float line_height = atlas.line_height > 0.0f ? atlas.line_height : static_cast<float>(config->fontSize);
-    if (line_height <= 0.0f)
-    {
-        line_height = static_cast<float>(config->fontSize);
-    }
-    dims.height = line_height;
+    dims.width = (std::max(max_x, pen_x) - min_x) * scale;
 
     return dims;
 }
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
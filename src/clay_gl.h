@@ -5,68 +5,246 @@
 #include <sstream>
 #include <vector>
 #include <unordered_map>
-#include <map>
+#include <memory>
+#include <charconv>
 
 #include "clay.h"
 
 #include "text.h"
 #include "rect.h"
+#include "stream_buffer.h"
+#include "gl_util.h"
 
-struct CharacterVertex
+// Index into ClayRenderCtx::image_textures plus one, 0 is never a valid image.
+// Goes into Clay_ImageElementConfig::imageData through clay_image_data
+typedef uint32_t ClayImageHandle;
+
+inline void* clay_image_data(ClayImageHandle handle)
+{
+    return reinterpret_cast<void*>(static_cast<uintptr_t>(handle));
+}
+
+// Flag on a font id for labels that show numbers, pass clay_numeric_font(font_id) as Clay_TextElementConfig::fontId.
+// Every digit takes the width of the widest one, so the label keeps its width while the value changes, and the text
+// is laid out without kerning or the run cache. Only pinned ASCII is drawn
+const uint16_t CLAY_NUMERIC_FONT = 0x8000;
+
+inline uint16_t clay_numeric_font(uint16_t font_id)
 {
-    glm::vec2 pos;
-    glm::vec2 uv;
+    return font_id | CLAY_NUMERIC_FONT;
+}
+
+// Writes value with decimals digits after the point into buffer, no terminator and no allocation.
+// Returns the length written, 0 if it does not fit
+inline size_t clay_format_number(char* buffer, size_t capacity, double value, int decimals)
+{
+    std::to_chars_result result = std::to_chars(buffer, buffer + capacity, value, std::chars_format::fixed, decimals);
+    return result.ec == std::errc() ? static_cast<size_t>(result.ptr - buffer) : 0;
+}
+
+enum ClayQuadMode : uint32_t
+{
+    CLAY_QUAD_SOLID = 0,
+    CLAY_QUAD_IMAGE = 1,
+    CLAY_QUAD_GLYPH = 2,
+    CLAY_QUAD_SDF = 3,
 };
 
-struct ClayRectVertex
+// Every primitive is one quad drawn by ui.vert/ui.frag, so mixed commands share draws. The vertex shader
+// reads these records from a buffer texture as 5 uvec4 texels, keep the layout in sync with ui.vert
+struct ClayQuad
 {
-    glm::vec2 pos;
-    glm::vec4 color;
-    glm::vec2 uv;
-
-    void print()
-    {
-        std::cout 
-        << "{\n" 
-            << "\t{" << pos.x << ", " << pos.y << "}\n"
-            << "\t{" << color.r << ", " << color.g << ", " << color.b << ", " << color.a << "}\n"
-            << "\t{" << uv.x << ", " << uv.y <<  "}\n"
-        << "}\n";
-    }
+    glm::vec4 bounds;        // x, y, width, height
+    glm::vec4 corner_radius; // top left, top right, bottom right, bottom left
+    glm::vec4 uv;            // left, top, right, bottom
+    glm::vec4 border_width;  // left, right, top, bottom, all zero for a filled rectangle
+    uint32_t color;          // RGBA8, one byte per channel in memory order
+    ClayQuadMode mode;
+    uint32_t padding[2];
 };
 
-struct ClayRenderCtx
+// Optional 48 byte encoding of ClayQuad (3 texels), read by ui.vert when built with CLAY_COMPACT_QUADS.
+// Positions stay float, Clay places scrolled content far outside the range of int16 or half floats
+struct ClayCompactQuad
+{
+    glm::vec4 bounds;          // x, y, width, height
+    uint16_t uv[4];            // unorm16 left, top, right, bottom
+    uint32_t color;            // RGBA8
+    uint32_t mode;
+    uint16_t corner_radius[4]; // Quarter pixels
+    uint16_t border_width[4];  // Pixels
+};
+
+// One glyph of instanced text (1 texel), ui.vert expands it into a quad from the atlas' instance_metrics
+struct ClayGlyphInstance
 {
-    std::vector<ClayRectVertex> rect_vertices;
-    uint32_t rect_VAO;
-    uint32_t rect_VBO;
-    uint32_t rect_shader;
+    float x;        // Pen position on the baseline
+    float y;
+    uint32_t glyph; // Glyph index in the low CLAY_GLYPH_INDEX_BITS, scale in 1/CLAY_GLYPH_SCALE_ONE steps above
+    uint32_t color; // RGBA8
+};
 
-    std::vector<CharacterVertex> text_vertices;
-    uint32_t text_VAO = 0;
-    uint32_t text_VBO = 0;
-    uint32_t text_shader;
+const uint32_t CLAY_GLYPH_INDEX_BITS = 14;
+const uint32_t CLAY_GLYPH_SCALE_ONE = 1024;
+static_assert((1u << CLAY_GLYPH_INDEX_BITS) >= CLAY_GLYPH_MAX_INDEX, "Glyph indices do not fit ClayGlyphInstance::glyph");
+
+// Textures bound for the pending batch, a change in either forces a flush. 0 means nothing has claimed the slot yet
+struct ClayBatchState
+{
+    uint32_t texture_id = 0; // Unit 0, sampled by CLAY_QUAD_IMAGE
+    uint32_t atlas_id = 0;   // Unit 1, sampled by CLAY_QUAD_GLYPH
+    uint32_t metrics_id = 0; // Unit 3, the atlas' instance metrics
+
+    // A batch holds either quad records or ClayGlyphInstance records, switching flushes.
+    // 0 for quads, otherwise the mode the instances are drawn with
+    uint32_t glyph_mode = 0;
+
+    uint32_t first = 0; // Byte offset of the batch in quad_stream
+    uint32_t count = 0; // Quads
+};
+
+const uint16_t CLAY_MAX_ATLAS_FONT_SIZE = 256; // Larger sizes are drawn scaled from this size's atlas
+const uint16_t CLAY_EXACT_ATLAS_FONT_SIZE = 32; // Larger sizes share an atlas per size bucket, see atlas_size_for
+const uint16_t CLAY_ATLAS_NONE = 0;            // Slot not built yet
+const uint16_t CLAY_ATLAS_FAILED = 0xFFFF;     // Slot could not be built, lookups fall back to the nearest built size
+
+struct ClayFont
+{
+    std::string filepath;
+    uint16_t atlas_slots[CLAY_MAX_ATLAS_FONT_SIZE + 1] = {}; // Indexed by pixel size, index into ClayRenderCtx::atlases plus one
+};
+
+struct ClayFontSize
+{
+    uint16_t font_id;
+    uint16_t font_size;
+};
+
+// Glyph of a cached text run, bounds relative to the pen origin on the baseline
+struct ClayGlyphQuad
+{
+    glm::vec4 bounds; // x, y, width, height
+    glm::vec4 uv;     // left, top, right, bottom
+    float pen_x;          // Pen position the glyph was placed from, for instanced text
+    uint32_t glyph_index; // See CharacterAtlas::instance_metrics
+    uint32_t page;        // Atlas page the uv refers to
+};
+
+// Laid out text reused by draw_clay_text while the same string is drawn with the same font, size and spacing
+struct ClayTextRun
+{
+    std::string text; // Compared on lookup so a hash collision never draws the wrong string
+    uint16_t font_id = 0;
+    uint16_t font_size = 0;
+    uint16_t letter_spacing = 0;
+
+    CharacterAtlas* atlas = nullptr;
+    uint32_t evictions = 0;                // atlas->cache_stats.evictions when laid out
+    std::vector<uint32_t> dynamic_codepoints; // Glyphs outside pinned ASCII, stale after any eviction
+    bool complete = false;                 // False when a glyph could not be made resident, rebuilt next time
+    std::vector<ClayGlyphQuad> quads;
+    uint32_t last_used = 0;
+};
+
+struct ClayRenderStats
+{
+    uint32_t commands = 0;
+    uint32_t batches = 0; // Draw calls needed for the last frame
+    uint32_t gl_calls = 0;        // State changes that reached GL
+    uint32_t gl_calls_elided = 0; // State changes skipped by ClayGLState
+    uint32_t text_run_hits = 0;
+    uint32_t text_run_misses = 0;
+    uint32_t text_lines_culled = 0; // Text commands entirely outside the active scissor
+    uint32_t glyphs_culled = 0;     // Glyphs of partly visible lines skipped the same way
+};
+
+struct ClayRenderCtx
+{
+    ClayStreamBuffer quad_stream;
+    uint32_t quad_texture = 0;        // Buffer texture over quad_stream, read by ui.vert
+    uint32_t quad_texture_generation = 0; // quad_stream.generation currently attached to quad_texture, 0 for none
+    uint32_t quad_VAO = 0;
+    uint32_t quad_EBO = 0;            // Static 0, 1, 2, 0, 2, 3 pattern shared by every quad
+    uint32_t quad_index_capacity = 0; // Quads quad_EBO has indices for
+    uint32_t quad_shader;
+    int32_t projection_location = -1; // Looked up once, samplers are fixed at init
+    glm::mat4 uploaded_projection;
+    bool projection_uploaded = false;
+    int32_t glyph_mode_location = -1;
+    uint32_t uploaded_glyph_mode = 0;
+    bool compact_quads = true; // Read by clay_init_render_ctx, selects ClayCompactQuad over ClayQuad records
+    uint32_t quad_record_size = sizeof(ClayQuad);
+    // Text is drawn as 16 byte ClayGlyphInstance records instead of quads. Instances cannot share a batch with
+    // quads, so alternating rectangles and labels cost a draw each. Off until that split is removed
+    bool glyph_instances = false;
 
     std::vector<glm::vec4> scissor_stack;
+    Rect clip_rect = {}; // Active scissor in window pixels, text outside it never reaches the stream
 
-    std::unordered_map<std::string, uint32_t> texture_ids; // uint32_t texture_id = texture_ids[image_filepath];
+    bool batching = true; // When false every command is flushed on its own
+    ClayBatchState batch;
+    ClayRenderStats stats;
+    ClayGLState gl;
+    uint32_t frame = 0; // Stamps glyph cache use, see get_character
 
-    std::vector<std::string> fonts;
-    std::map<std::string, std::map<uint16_t, CharacterAtlas>> character_atlases; // uint32_t atlas_id = character_atlases[font_filepath][font_size].texture_id;
+    std::vector<uint32_t> image_textures; // uint32_t texture_id = image_textures[handle - 1];
+    std::unordered_map<std::string, ClayImageHandle> image_handles; // Only used when registering and looking up by path
+
+    bool sdf_text = false;        // Read by clay_init_render_ctx, one signed distance field atlas per font serves every size
+    uint16_t sdf_pixel_size = 48; // Size the SDF atlases are rasterized at
+
+    FontLibrary font_library;
+    std::string atlas_cache_dir = "atlas_cache"; // Baked atlases are read from and written to here, empty disables the cache
+    std::vector<ClayFont> fonts;                          // Indexed by font id
+    std::vector<std::unique_ptr<CharacterAtlas>> atlases; // CharacterAtlas* atlas = atlases[fonts[font_id].atlas_slots[font_size] - 1].get();
+    std::vector<uint32_t> codepoints; // Scratch for decode_utf8 in draw_clay_text
+    std::vector<ClayGlyphQuad> numeric_quads; // Scratch for numeric labels, which change too often to cache as runs
+
+    bool text_run_cache = true;
+    uint32_t text_run_max_age = 120; // Frames a run may go unused before it is dropped
+    std::unordered_map<uint64_t, ClayTextRun> text_runs;
 
     glm::mat4 projection;
 };
 
 std::string read_file(std::string filepath);
 
+// Atlas to draw font_id at font_size with, built on first use. Falls back to the nearest built size when that fails.
+// scale converts its pixels to font_size. nullptr if the font has no atlas at all
+CharacterAtlas* find_character_atlas(ClayRenderCtx* ctx, uint16_t font_id, uint16_t font_size, float* scale);
+
+// Builds atlases up front so the first frame using them does not pay for rasterization
+void clay_warm_up_fonts(ClayRenderCtx* ctx, const std::vector<ClayFontSize>& font_sizes);
+
 uint16_t get_font_id(ClayRenderCtx* ctx, std::string font);
 
-uint32_t create_shader(std::string vertex_file, std::string fragment_file);
+// Loads the image and returns its handle, or the existing handle if it was already registered. 0 on failure
+ClayImageHandle clay_register_image(ClayRenderCtx* ctx, std::string filepath);
+
+// 0 if the image was never registered
+ClayImageHandle get_image_handle(ClayRenderCtx* ctx, std::string filepath);
+
+// defines is inserted after the #version line of both stages
+uint32_t create_shader(std::string vertex_file, std::string fragment_file, std::string defines = "");
 
 void clay_init_render_ctx(ClayRenderCtx* ctx, std::vector<std::string> image_filepaths, std::vector<std::string> font_filepaths);
 
 void clay_render(Clay_RenderCommandArray commands, ClayRenderCtx* ctx, int window_width, int window_height);
 
+// Pass 0 for a texture the caller does not sample
+void set_batch_state(ClayRenderCtx* ctx, uint32_t texture_id, uint32_t atlas_id);
+
+void flush_batch(ClayRenderCtx* ctx);
+
+// Encodes the quad straight into the stream buffer as part of the current batch
+void push_quad(ClayRenderCtx* ctx, const ClayQuad& quad);
+
+// Same for a glyph of atlas, flushes when the batch holds quads or another atlas' glyphs
+void push_glyph_instance(ClayRenderCtx* ctx, const CharacterAtlas* atlas, uint32_t page, const ClayGlyphInstance& instance);
+
+// Cached layout of text in atlas at font_size, rebuilt when missing or stale
+const ClayTextRun* get_text_run(ClayRenderCtx* ctx, Clay_StringSlice text, uint16_t font_id, uint16_t font_size, uint16_t letter_spacing, CharacterAtlas* atlas, float scale);
+
 void draw_clay_text_debug(ClayRenderCtx* ctx, Clay_RenderCommand command);
 
 Clay_Dimensions MeasureText(Clay_StringSlice text, Clay_TextElementConfig* config, void* user_data);
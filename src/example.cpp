@@ -28,6 +28,7 @@ int window_width;
 int window_height;
 
 ClayRenderCtx render_ctx;
+ClayImageHandle pikachu_image;
 
 // Input variables
 glm::vec2 scroll;
@@ -163,6 +164,9 @@ int main()
         "fonts/arial.ttf",
     };
     clay_init_render_ctx(&render_ctx, image_filepaths, font_filepaths);
+    pikachu_image = get_image_handle(&render_ctx, "images/pikachu.png");
+    uint16_t arial = get_font_id(&render_ctx, "fonts/arial.ttf");
+    clay_warm_up_fonts(&render_ctx, { { arial, 14 }, { arial, 16 }, { arial, 24 } });
 
 
     while(!glfwWindowShouldClose(window))
@@ -770,7 +774,7 @@ Clay_RenderCommandArray create_layout()
                         .layout = { .sizing = layout_expand },
                         .backgroundColor = { 255, 255, 255, 255 },
                         .aspectRatio = { .aspectRatio = 1.0f },
-                        .image = { .imageData = (void*)"images/pikachu.png" },
+                        .image = { .imageData = clay_image_data(pikachu_image) },
                     }) {}
 
                     sidebar_documents_component();
@@ -0,0 +1,197 @@
+#include "font.h"
+
+#include <iostream>
+
+#include FT_MODULE_H
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+bool map_file(MappedFile* file, const std::string& filepath)
+{
+    file->data = nullptr;
+    file->size = 0;
+
+#ifdef _WIN32
+    HANDLE handle = CreateFileA(filepath.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (handle == INVALID_HANDLE_VALUE)
+    {
+        return false;
+    }
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(handle, &size) || size.QuadPart == 0)
+    {
+        CloseHandle(handle);
+        return false;
+    }
+
+    // The view keeps the file alive after both handles are closed
+    HANDLE mapping = CreateFileMappingA(handle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    CloseHandle(handle);
+    if (!mapping)
+    {
+        return false;
+    }
+    void* data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(mapping);
+    if (!data)
+    {
+        return false;
+    }
+
+    file->data = static_cast<const uint8_t*>(data);
+    file->size = static_cast<size_t>(size.QuadPart);
+#else
+    int fd = open(filepath.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        return false;
+    }
+
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size == 0)
+    {
+        close(fd);
+        return false;
+    }
+
+    void* data = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+    {
+        return false;
+    }
+
+    file->data = static_cast<const uint8_t*>(data);
+    file->size = static_cast<size_t>(info.st_size);
+#endif
+
+    return true;
+}
+
+uint64_t hash_bytes(const void* data, size_t size, uint64_t seed)
+{
+    const uint8_t* bytes = static_cast<const uint8_t*>(data);
+    uint64_t hash = seed;
+    for (size_t i = 0; i < size; i++)
+    {
+        hash = (hash ^ bytes[i]) * 0x100000001B3ull;
+    }
+    return hash;
+}
+
+void unmap_file(MappedFile* file)
+{
+    if (!file->data)
+    {
+        return;
+    }
+
+#ifdef _WIN32
+    UnmapViewOfFile(file->data);
+#else
+    munmap(const_cast<uint8_t*>(file->data), file->size);
+#endif
+
+    file->data = nullptr;
+    file->size = 0;
+}
+
+int font_library_init(FontLibrary* library)
+{
+    if (FT_Init_FreeType(&library->ft))
+    {
+        std::cout << "ERROR::FREETYPE: Could not init FreeType Library" << std::endl;
+        library->ft = nullptr;
+        return -1;
+    }
+
+    // Applies to every face of the library
+    FT_Int spread = CLAY_FONT_SDF_SPREAD;
+    FT_Property_Set(library->ft, "sdf", "spread", &spread);
+
+    return 0;
+}
+
+int open_font_face(FT_Library ft, const FontFace* font, FT_Face* face)
+{
+    if (FT_New_Memory_Face(ft, font->file.data, static_cast<FT_Long>(font->file.size), 0, face))
+    {
+        return -1;
+    }
+
+    if (FT_Select_Charmap(*face, FT_ENCODING_UNICODE))
+    {
+        FT_Done_Face(*face);
+        *face = nullptr;
+        return -1;
+    }
+
+    return 0;
+}
+
+FontFace* font_library_open(FontLibrary* library, const std::string& filepath)
+{
+    auto it = library->faces.find(filepath);
+    if (it != library->faces.end())
+    {
+        return it->second.get();
+    }
+
+    // Failures are remembered as a null entry so the file is not reopened on every lookup
+    std::unique_ptr<FontFace>& entry = library->faces[filepath];
+    if (!library->ft)
+    {
+        return nullptr;
+    }
+
+    std::unique_ptr<FontFace> font = std::make_unique<FontFace>();
+    font->filepath = filepath;
+
+    if (!map_file(&font->file, filepath))
+    {
+        std::cout << "ERROR::FREETYPE: Failed to load " + filepath << std::endl;
+        return nullptr;
+    }
+
+    font->content_hash = hash_bytes(font->file.data, font->file.size);
+
+    if (open_font_face(library->ft, font.get(), &font->face))
+    {
+        std::cout << "ERROR::FREETYPE: Failed to load " + filepath << std::endl;
+        unmap_file(&font->file);
+        return nullptr;
+    }
+
+    entry = std::move(font);
+    return entry.get();
+}
+
+void font_library_destroy(FontLibrary* library)
+{
+    // FT_Done_Face also releases every FT_Size created on the face
+    for (auto& [filepath, font] : library->faces)
+    {
+        if (font)
+        {
+            FT_Done_Face(font->face);
+            unmap_file(&font->file);
+        }
+    }
+    library->faces.clear();
+
+    if (library->ft)
+    {
+        FT_Done_FreeType(library->ft);
+        library->ft = nullptr;
+    }
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+
+#include <ft2build.h>
+#include FT_FREETYPE_H
+
+const int CLAY_FONT_SDF_SPREAD = 8; // Pixels at the SDF reference size, enough for scaling up several times
+
+// Read only view of a whole file, the mapping is released by unmap_file
+struct MappedFile
+{
+    const uint8_t* data = nullptr;
+    size_t size = 0;
+};
+
+bool map_file(MappedFile* file, const std::string& filepath);
+
+// 64 bit FNV-1a, chain calls by passing the previous result as seed
+uint64_t hash_bytes(const void* data, size_t size, uint64_t seed = 0xCBF29CE484222325ull);
+
+void unmap_file(MappedFile* file);
+
+// A font file mapped once and parsed once. Atlases give it their own FT_Size and activate it before loading glyphs
+struct FontFace
+{
+    std::string filepath;
+    MappedFile file;
+    uint64_t content_hash = 0; // hash_bytes of the whole file
+    FT_Face face = nullptr;
+};
+
+struct FontLibrary
+{
+    FT_Library ft = nullptr;
+    std::unordered_map<std::string, std::unique_ptr<FontFace>> faces;
+};
+
+int font_library_init(FontLibrary* library);
+
+// Opens another face over the mapped file of font, for threads that cannot share font->face
+int open_font_face(FT_Library ft, const FontFace* font, FT_Face* face);
+
+// Maps and opens the font the first time it is asked for, nullptr if it cannot be loaded
+FontFace* font_library_open(FontLibrary* library, const std::string& filepath);
+
+void font_library_destroy(FontLibrary* library);
@@ -22,4 +22,124 @@ void checkOpenGLErrors(const char* context)
         }
         std::cout << std::endl;
     }
-}
\ No newline at end of file
+}
+
+void gl_state_reset(ClayGLState* state)
+{
+    state->program = CLAY_GL_UNKNOWN;
+    state->vertex_array = CLAY_GL_UNKNOWN;
+    state->active_texture = CLAY_GL_UNKNOWN;
+    for (uint32_t& texture : state->textures)
+    {
+        texture = CLAY_GL_UNKNOWN;
+    }
+    state->blend = CLAY_GL_UNKNOWN;
+    state->scissor_test = CLAY_GL_UNKNOWN;
+    state->scissor[0] = state->scissor[1] = state->scissor[2] = state->scissor[3] = -1;
+}
+
+void gl_use_program(ClayGLState* state, uint32_t program)
+{
+    if (state->program == program)
+    {
+        state->elided++;
+        return;
+    }
+    glUseProgram(program);
+    state->program = program;
+    state->calls++;
+}
+
+void gl_bind_vertex_array(ClayGLState* state, uint32_t vertex_array)
+{
+    if (state->vertex_array == vertex_array)
+    {
+        state->elided++;
+        return;
+    }
+    glBindVertexArray(vertex_array);
+    state->vertex_array = vertex_array;
+    state->calls++;
+}
+
+void gl_active_texture(ClayGLState* state, uint32_t unit)
+{
+    if (state->active_texture == unit)
+    {
+        state->elided++;
+        return;
+    }
+    glActiveTexture(GL_TEXTURE0 + unit);
+    state->active_texture = unit;
+    state->calls++;
+}
+
+void gl_bind_texture(ClayGLState* state, uint32_t unit, uint32_t target, uint32_t texture)
+{
+    // Units are only ever bound to one target by the renderer, so the id alone identifies the binding
+    if (unit < CLAY_GL_TEXTURE_UNITS && state->textures[unit] == texture)
+    {
+        state->elided++;
+        return;
+    }
+    gl_active_texture(state, unit);
+    glBindTexture(target, texture);
+    if (unit < CLAY_GL_TEXTURE_UNITS)
+    {
+        state->textures[unit] = texture;
+    }
+    state->calls++;
+}
+
+void gl_set_blend(ClayGLState* state, bool enabled)
+{
+    if (state->blend == static_cast<uint32_t>(enabled))
+    {
+        state->elided++;
+        return;
+    }
+    if (enabled)
+    {
+        glEnable(GL_BLEND);
+    }
+    else
+    {
+        glDisable(GL_BLEND);
+    }
+    state->blend = enabled;
+    state->calls++;
+}
+
+void gl_set_scissor_test(ClayGLState* state, bool enabled)
+{
+    if (state->scissor_test == static_cast<uint32_t>(enabled))
+    {
+        state->elided++;
+        return;
+    }
+    if (enabled)
+    {
+        glEnable(GL_SCISSOR_TEST);
+    }
+    else
+    {
+        glDisable(GL_SCISSOR_TEST);
+    }
+    state->scissor_test = enabled;
+    state->calls++;
+}
+
+void gl_scissor(ClayGLState* state, int32_t x, int32_t y, int32_t width, int32_t height)
+{
+    if (state->scissor[0] == x && state->scissor[1] == y && state->scissor[2] == width && state->scissor[3] == height)
+    {
+        state->elided++;
+        return;
+    }
+    glScissor(x, y, width, height);
+    state->scissor[0] = x;
+    state->scissor[1] = y;
+    state->scissor[2] = width;
+    state->scissor[3] = height;
+    state->calls++;
+}
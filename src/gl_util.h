@@ -1,5 +1,41 @@
 #pragma once
 
+#include <cstdint>
 
+const uint32_t CLAY_GL_TEXTURE_UNITS = 4;
+const uint32_t CLAY_GL_UNKNOWN = 0xFFFFFFFF;
 
-void checkOpenGLErrors(const char* context) ;
\ No newline at end of file
+// Mirror of the GL state the renderer touches, used to skip calls that would not change anything.
+// Reset at the start of every frame since the application may change state between frames, and after
+// anything that binds behind its back. Resetting keeps the counters, clay_render zeroes them once per frame
+struct ClayGLState
+{
+    uint32_t program;
+    uint32_t vertex_array;
+    uint32_t active_texture;
+    uint32_t textures[CLAY_GL_TEXTURE_UNITS];
+    uint32_t blend;
+    uint32_t scissor_test;
+    int32_t scissor[4];
+
+    uint32_t calls = 0;   // Calls that reached GL
+    uint32_t elided = 0;  // Calls skipped because the state already matched
+};
+
+void checkOpenGLErrors(const char* context) ;
+
+void gl_state_reset(ClayGLState* state);
+
+void gl_use_program(ClayGLState* state, uint32_t program);
+
+void gl_bind_vertex_array(ClayGLState* state, uint32_t vertex_array);
+
+void gl_active_texture(ClayGLState* state, uint32_t unit);
+
+void gl_bind_texture(ClayGLState* state, uint32_t unit, uint32_t target, uint32_t texture);
+
+void gl_set_blend(ClayGLState* state, bool enabled);
+
+void gl_set_scissor_test(ClayGLState* state, bool enabled);
+
+void gl_scissor(ClayGLState* state, int32_t x, int32_t y, int32_t width, int32_t height);
@@ -0,0 +1,71 @@
+#version 330 core
+in vec2 frag_local;
+in vec2 frag_uv;
+in vec4 frag_color;
+flat in vec2 frag_half_size;
+flat in vec4 frag_radius;
+flat in vec4 frag_border;
+flat in uint frag_mode;
+out vec4 color;
+
+uniform sampler2D tex_sampler;
+uniform sampler2D character_atlas;
+
+const uint MODE_SOLID = 0u;
+const uint MODE_IMAGE = 1u;
+const uint MODE_GLYPH = 2u;
+const uint MODE_SDF = 3u;
+
+// Signed distance to a rounded rectangle centered on the origin, negative inside
+float rounded_rect_sdf(vec2 p, vec2 half_size, vec4 radius)
+{
+    float r = p.x < 0.0 ? (p.y < 0.0 ? radius.x : radius.w) : (p.y < 0.0 ? radius.y : radius.z);
+    vec2 q = abs(p) - half_size + r;
+    return min(max(q.x, q.y), 0.0) + length(max(q, 0.0)) - r;
+}
+
+void main()
+{
+    if (frag_mode == MODE_GLYPH)
+    {
+        color = vec4(frag_color.rgb, frag_color.a * texture(character_atlas, frag_uv).r);
+        return;
+    }
+
+    if (frag_mode == MODE_SDF)
+    {
+        // 0.5 is the outline, smooth over about one screen pixel whatever the scale
+        float field = texture(character_atlas, frag_uv).r;
+        float width = max(fwidth(field) * 0.75, 1.0 / 255.0);
+        color = vec4(frag_color.rgb, frag_color.a * smoothstep(0.5 - width, 0.5 + width, field));
+        return;
+    }
+
+    float dist = rounded_rect_sdf(frag_local, frag_half_size, frag_radius);
+    float coverage = clamp(0.5 - dist, 0.0, 1.0);
+
+    if (any(greaterThan(frag_border, vec4(0.0))))
+    {
+        // Cut out the inner rounded rect, inset by the width of each side
+        vec2 inner_min = -frag_half_size + frag_border.xz;
+        vec2 inner_max = frag_half_size - frag_border.yw;
+        vec2 inner_half_size = max((inner_max - inner_min) * 0.5, vec2(0.0));
+        vec2 inner_center = (inner_min + inner_max) * 0.5;
+        vec4 corner_width = vec4(
+            max(frag_border.x, frag_border.z),
+            max(frag_border.y, frag_border.z),
+            max(frag_border.y, frag_border.w),
+            max(frag_border.x, frag_border.w)
+        );
+        vec4 inner_radius = max(frag_radius - corner_width, vec4(0.0));
+        float inner_dist = rounded_rect_sdf(frag_local - inner_center, inner_half_size, inner_radius);
+        coverage *= clamp(0.5 + inner_dist, 0.0, 1.0);
+    }
+
+    color = frag_color;
+    if (frag_mode == MODE_IMAGE)
+    {
+        color *= texture(tex_sampler, frag_uv);
+    }
+    color.a *= coverage;
+}
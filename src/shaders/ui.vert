@@ -0,0 +1,86 @@
+#version 330 core
+out vec2 frag_local;
+out vec2 frag_uv;
+out vec4 frag_color;
+flat out vec2 frag_half_size;
+flat out vec4 frag_radius;
+flat out vec4 frag_border;
+flat out uint frag_mode;
+
+uniform mat4 projection;
+uniform usamplerBuffer quads; // ClayQuad or ClayCompactQuad records, ClayGlyphInstance when glyph_mode is set
+uniform samplerBuffer glyph_metrics; // CharacterAtlas::instance_metrics of the batch's atlas
+uniform uint glyph_mode;             // 0 for quad records, otherwise the mode every glyph instance is drawn with
+
+const uint MODE_GLYPH = 2u;
+const uint MODE_SDF = 3u;
+const uint GLYPH_INDEX_BITS = 14u;    // CLAY_GLYPH_INDEX_BITS
+const float GLYPH_SCALE_ONE = 1024.0; // CLAY_GLYPH_SCALE_ONE
+
+void main()
+{
+    // Indices 0, 1, 2, 0, 2, 3 per quad: top left, bottom left, bottom right, top right
+    int quad = gl_VertexID >> 2;
+    int corner_index = gl_VertexID & 3;
+    vec2 corner = vec2(corner_index == 2 || corner_index == 3, corner_index == 1 || corner_index == 2);
+
+    vec4 bounds;
+    vec4 uv_bounds;
+    vec4 corner_radius;
+    vec4 border_width;
+    uint color_bits;
+    uint mode;
+    if (glyph_mode != 0u)
+    {
+        // ClayGlyphInstance, placed from the pen position with the glyph's bearing and size
+        uvec4 instance = texelFetch(quads, quad); // x, y, glyph, color
+        int glyph = int(instance.z & ((1u << GLYPH_INDEX_BITS) - 1u));
+        float scale = float(instance.z >> GLYPH_INDEX_BITS) / GLYPH_SCALE_ONE;
+        vec4 placement = texelFetch(glyph_metrics, glyph * 2 + 1); // bearing x, -bearing y, width, height
+        bounds = vec4(uintBitsToFloat(instance.xy) + placement.xy * scale, placement.zw * scale);
+        uv_bounds = texelFetch(glyph_metrics, glyph * 2);
+        corner_radius = vec4(0.0);
+        border_width = vec4(0.0);
+        color_bits = instance.w;
+        mode = glyph_mode;
+    }
+    else
+    {
+#ifdef CLAY_COMPACT_QUADS
+        // ClayCompactQuad
+        int texel = quad * 3;
+        bounds = uintBitsToFloat(texelFetch(quads, texel + 0));
+        uvec4 fields = texelFetch(quads, texel + 1); // uv, uv, color, mode
+        uvec4 shape = texelFetch(quads, texel + 2);  // corner radius, corner radius, border, border
+        uv_bounds = vec4(fields.x & 0xFFFFu, fields.x >> 16, fields.y & 0xFFFFu, fields.y >> 16) / 65535.0;
+        corner_radius = vec4(shape.x & 0xFFFFu, shape.x >> 16, shape.y & 0xFFFFu, shape.y >> 16) * 0.25;
+        border_width = vec4(shape.z & 0xFFFFu, shape.z >> 16, shape.w & 0xFFFFu, shape.w >> 16);
+        color_bits = fields.z;
+        mode = fields.w;
+#else
+        // ClayQuad
+        int texel = quad * 5;
+        bounds = uintBitsToFloat(texelFetch(quads, texel + 0));        // x, y, width, height
+        corner_radius = uintBitsToFloat(texelFetch(quads, texel + 1)); // top left, top right, bottom right, bottom left
+        uv_bounds = uintBitsToFloat(texelFetch(quads, texel + 2));     // left, top, right, bottom
+        border_width = uintBitsToFloat(texelFetch(quads, texel + 3));  // left, right, top, bottom
+        uvec4 fields = texelFetch(quads, texel + 4);                   // color, mode
+        color_bits = fields.x;
+        mode = fields.y;
+#endif
+    }
+
+    // Grow shapes by a pixel so the anti-aliased edge is not clipped, glyphs already carry their own padding
+    float padding = (mode == MODE_GLYPH || mode == MODE_SDF) ? 0.0 : 1.0;
+    vec2 half_size = bounds.zw * 0.5;
+    vec2 local = (corner * 2.0 - 1.0) * (half_size + padding);
+    gl_Position = projection * vec4(bounds.xy + half_size + local, 0.0, 1.0);
+
+    frag_local = local;
+    frag_uv = mix(uv_bounds.xy, uv_bounds.zw, (local + half_size) / max(bounds.zw, vec2(0.0001)));
+    frag_color = vec4((uvec4(color_bits) >> uvec4(0u, 8u, 16u, 24u)) & 0xFFu) / 255.0;
+    frag_half_size = half_size;
+    frag_radius = corner_radius;
+    frag_border = border_width;
+    frag_mode = mode;
+}
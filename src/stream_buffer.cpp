@@ -0,0 +1,140 @@
+#include "stream_buffer.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include "gl_util.h"
+
+void create_storage(ClayStreamBuffer* stream)
+{
+    glGenBuffers(1, &stream->buffer);
+    glBindBuffer(GL_ARRAY_BUFFER, stream->buffer);
+
+    if (stream->persistent)
+    {
+        GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+        GLsizeiptr size = static_cast<GLsizeiptr>(stream->region_size) * CLAY_STREAM_REGIONS;
+        glBufferStorage(GL_ARRAY_BUFFER, size, nullptr, flags);
+        stream->mapped = static_cast<uint8_t*>(glMapBufferRange(GL_ARRAY_BUFFER, 0, size, flags));
+    }
+    else
+    {
+        glBufferData(GL_ARRAY_BUFFER, stream->region_size, nullptr, GL_STREAM_DRAW);
+        stream->staging.resize(stream->region_size);
+    }
+
+    stream->region = 0;
+    stream->offset = 0;
+    stream->uploaded = 0;
+    stream->generation++;
+
+    checkOpenGLErrors("Stream buffer creation");
+}
+
+void stream_buffer_init(ClayStreamBuffer* stream, uint32_t region_size)
+{
+    // glad only loads glBufferStorage when the context reports GL 4.4
+    stream->persistent = GLAD_GL_VERSION_4_4 && glBufferStorage != nullptr;
+    stream->region_size = region_size;
+    create_storage(stream);
+}
+
+void wait_fence(GLsync& fence)
+{
+    if (!fence)
+    {
+        return;
+    }
+
+    GLenum result = glClientWaitSync(fence, 0, 0);
+    while (result == GL_TIMEOUT_EXPIRED)
+    {
+        result = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000);
+    }
+    glDeleteSync(fence);
+    fence = nullptr;
+}
+
+void stream_buffer_begin_frame(ClayStreamBuffer* stream)
+{
+    if (stream->persistent)
+    {
+        stream->region = (stream->region + 1) % CLAY_STREAM_REGIONS;
+        wait_fence(stream->fences[stream->region]);
+    }
+    else
+    {
+        // Orphan last frame's storage so the driver does not have to wait for it
+        glBindBuffer(GL_ARRAY_BUFFER, stream->buffer);
+        glBufferData(GL_ARRAY_BUFFER, stream->region_size, nullptr, GL_STREAM_DRAW);
+    }
+
+    stream->offset = 0;
+    stream->uploaded = 0;
+}
+
+void stream_buffer_end_frame(ClayStreamBuffer* stream)
+{
+    if (stream->persistent)
+    {
+        stream->fences[stream->region] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    }
+}
+
+void* stream_buffer_alloc(ClayStreamBuffer* stream, uint32_t size, uint32_t* buffer_offset)
+{
+    if (stream->offset + size > stream->region_size)
+    {
+        return nullptr;
+    }
+
+    uint8_t* base = stream->persistent ? stream->mapped + stream->region * stream->region_size : stream->staging.data();
+    void* ptr = base + stream->offset;
+
+    *buffer_offset = (stream->persistent ? stream->region * stream->region_size : 0) + stream->offset;
+    stream->offset += size;
+
+    return ptr;
+}
+
+void stream_buffer_align(ClayStreamBuffer* stream, uint32_t alignment)
+{
+    uint32_t aligned = (stream->offset + alignment - 1) / alignment * alignment;
+    stream->offset = std::min(aligned, stream->region_size);
+}
+
+void stream_buffer_commit(ClayStreamBuffer* stream)
+{
+    // Persistent mappings are coherent, nothing to do
+    if (stream->persistent || stream->uploaded == stream->offset)
+    {
+        return;
+    }
+
+    glBindBuffer(GL_ARRAY_BUFFER, stream->buffer);
+    glBufferSubData(GL_ARRAY_BUFFER, stream->uploaded, stream->offset - stream->uploaded, stream->staging.data() + stream->uploaded);
+    stream->uploaded = stream->offset;
+}
+
+void stream_buffer_grow(ClayStreamBuffer* stream, uint32_t min_size)
+{
+    if (stream->persistent)
+    {
+        // Pending draws keep the old storage alive until they finish, so only the fences need dropping
+        glBindBuffer(GL_ARRAY_BUFFER, stream->buffer);
+        glUnmapBuffer(GL_ARRAY_BUFFER);
+        for (GLsync& fence : stream->fences)
+        {
+            if (fence)
+            {
+                glDeleteSync(fence);
+                fence = nullptr;
+            }
+        }
+        stream->mapped = nullptr;
+    }
+
+    glDeleteBuffers(1, &stream->buffer);
+    stream->region_size = std::max(stream->region_size * 2, min_size);
+    create_storage(stream);
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include <glad/glad.h>
+
+const uint32_t CLAY_STREAM_REGIONS = 3; // Frames the CPU may run ahead of the GPU
+
+// Vertex buffer written every frame. With GL 4.4 / ARB_buffer_storage the whole buffer is persistently
+// mapped and split into CLAY_STREAM_REGIONS regions guarded by fences. Otherwise writes go to a CPU copy
+// and are uploaded with glBufferSubData into storage that is orphaned at the start of each frame.
+struct ClayStreamBuffer
+{
+    uint32_t buffer = 0;
+    uint32_t generation = 0; // Bumped whenever the storage is replaced, GL may hand the freed buffer name straight back
+    uint32_t region_size = 0;
+    uint32_t region = 0;
+    uint32_t offset = 0;    // Write cursor inside the current region
+    uint32_t uploaded = 0;  // Fallback only, bytes of the region already sent with glBufferSubData
+
+    bool persistent = false;
+    uint8_t* mapped = nullptr;
+    std::vector<uint8_t> staging;
+    GLsync fences[CLAY_STREAM_REGIONS] = {};
+};
+
+void stream_buffer_init(ClayStreamBuffer* stream, uint32_t region_size);
+
+void stream_buffer_begin_frame(ClayStreamBuffer* stream);
+
+void stream_buffer_end_frame(ClayStreamBuffer* stream);
+
+// Returns nullptr when the region is full, buffer_offset receives the offset of the allocation in the GL buffer
+void* stream_buffer_alloc(ClayStreamBuffer* stream, uint32_t size, uint32_t* buffer_offset);
+
+// Moves the write cursor up to a multiple of alignment, offsets in the GL buffer line up as long as
+// region_size is a multiple of it too. A full region stays full, so the next alloc still fails
+void stream_buffer_align(ClayStreamBuffer* stream, uint32_t alignment);
+
+// Makes everything written so far visible to the GPU, call before drawing from the buffer
+void stream_buffer_commit(ClayStreamBuffer* stream);
+
+// Replaces the storage with one that fits at least min_size more bytes, anything not yet drawn is lost
+void stream_buffer_grow(ClayStreamBuffer* stream, uint32_t min_size);
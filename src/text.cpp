@@ -3,33 +3,520 @@
 #include <vector>
 #include <string>
 #include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <cassert>
+#include <filesystem>
+#include <fstream>
+
+#include FT_SIZES_H
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define CLAY_UTF8_AVX2
+#endif
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define CLAY_UTF8_SSE2
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#include <arm_neon.h>
+#define CLAY_UTF8_NEON
+#endif
 
 #include "gl_util.h"
 
 
 
-int create_character_atlas(CharacterAtlas* atlas, std::string font_filepath, uint16_t font_size)
+// Dynamic pages are at least this many ems along each side
+const uint32_t CLAY_GLYPH_PAGE_EMS = 8;
+
+
+static uint32_t glyph_table_home(const GlyphTable* table, uint32_t codepoint)
 {
-    FT_Library ft;
-    if (FT_Init_FreeType(&ft))
-    {
-        std::cout << "ERROR::FREETYPE: Could not init FreeType Library" << std::endl;
-        return -1;
+    return (codepoint * 0x9E3779B1u) >> (32 - table->bits);
+}
+
+static void glyph_table_init(GlyphTable* table, uint32_t capacity)
+{
+    table->bits = 1;
+    while ((1u << table->bits) < capacity * 2) {
+        table->bits++;
     }
+    table->keys.assign(1u << table->bits, GLYPH_TABLE_EMPTY);
+    table->values.assign(1u << table->bits, 0);
+    table->count = 0;
+}
 
-    FT_Face face;
-    if (FT_New_Face(ft, font_filepath.c_str(), 0, &face)) {
-        std::cout << "ERROR::FREETYPE: Failed to load " + font_filepath << std::endl;
-        return -1;
+static uint32_t glyph_table_find(const GlyphTable* table, uint32_t codepoint)
+{
+    uint32_t mask = (1u << table->bits) - 1;
+    for (uint32_t i = glyph_table_home(table, codepoint); ; i = (i + 1) & mask) {
+        if (table->keys[i] == codepoint) {
+            return table->values[i];
+        }
+        if (table->keys[i] == GLYPH_TABLE_EMPTY) {
+            return GLYPH_TABLE_EMPTY;
+        }
     }
+}
 
-    if (FT_Select_Charmap(face, FT_ENCODING_UNICODE)) {
-        std::cout << "ERROR::FREETYPE: Failed to load " + font_filepath << std::endl;
-        return -1;
+// Doubles before passing half load, so probing always ends
+static void glyph_table_insert(GlyphTable* table, uint32_t codepoint, uint32_t slot)
+{
+    if ((table->count + 1) * 2 > (1u << table->bits)) {
+        GlyphTable grown;
+        glyph_table_init(&grown, 1u << table->bits);
+        for (uint32_t i = 0; i < table->keys.size(); ++i) {
+            if (table->keys[i] != GLYPH_TABLE_EMPTY) {
+                glyph_table_insert(&grown, table->keys[i], table->values[i]);
+            }
+        }
+        *table = std::move(grown);
+    }
+
+    uint32_t mask = (1u << table->bits) - 1;
+    uint32_t i = glyph_table_home(table, codepoint);
+    while (table->keys[i] != GLYPH_TABLE_EMPTY && table->keys[i] != codepoint) {
+        i = (i + 1) & mask;
+    }
+    if (table->keys[i] == GLYPH_TABLE_EMPTY) {
+        table->count++;
+    }
+    table->keys[i] = codepoint;
+    table->values[i] = slot;
+}
+
+static void glyph_table_erase(GlyphTable* table, uint32_t codepoint)
+{
+    uint32_t mask = (1u << table->bits) - 1;
+    uint32_t i = glyph_table_home(table, codepoint);
+    while (table->keys[i] != codepoint) {
+        if (table->keys[i] == GLYPH_TABLE_EMPTY) {
+            return;
+        }
+        i = (i + 1) & mask;
+    }
+
+    // Shift later entries of the probe run back so lookups never stop early at the hole
+    for (uint32_t j = (i + 1) & mask; table->keys[j] != GLYPH_TABLE_EMPTY; j = (j + 1) & mask) {
+        uint32_t home = glyph_table_home(table, table->keys[j]);
+        bool stays = (i <= j) ? (i < home && home <= j) : (i < home || home <= j);
+        if (!stays) {
+            table->keys[i] = table->keys[j];
+            table->values[i] = table->values[j];
+            i = j;
+        }
+    }
+    table->keys[i] = GLYPH_TABLE_EMPTY;
+    table->count--;
+}
+
+// Instanced text reads the glyph's placement from here instead of a CPU built quad
+static void write_instance_metrics(CharacterAtlas* atlas, uint32_t glyph_index, const Character& character)
+{
+    const Rect& uv = character.bounds;
+    if (atlas->instance_metrics.size() < (glyph_index + 1) * 2) {
+        atlas->instance_metrics.resize((glyph_index + 1) * 2, glm::vec4(0.0f));
+    }
+    atlas->instance_metrics[glyph_index * 2] = glm::vec4(uv.left, uv.top, uv.right, uv.bot);
+    atlas->instance_metrics[glyph_index * 2 + 1] = glm::vec4(character.bearing.x, -character.bearing.y, character.size.x, character.size.y);
+
+    if (atlas->metrics_dirty_last <= atlas->metrics_dirty_first) {
+        atlas->metrics_dirty_first = glyph_index;
+        atlas->metrics_dirty_last = glyph_index + 1;
+        return;
+    }
+    atlas->metrics_dirty_first = std::min(atlas->metrics_dirty_first, glyph_index);
+    atlas->metrics_dirty_last = std::max(atlas->metrics_dirty_last, glyph_index + 1);
+}
+
+static void mark_dirty(AtlasPage* page, uint32_t top, uint32_t bot)
+{
+    if (page->dirty_bot <= page->dirty_top) {
+        page->dirty_top = top;
+        page->dirty_bot = bot;
+        return;
+    }
+    page->dirty_top = std::min(page->dirty_top, top);
+    page->dirty_bot = std::max(page->dirty_bot, bot);
+}
+
+void skyline_init(SkylinePacker* packer, uint32_t width, uint32_t height)
+{
+    packer->width = width;
+    packer->height = height;
+    packer->skyline.assign(1, { 0, 0, width });
+    packer->used_area = 0;
+}
+
+// Top of the rectangle when its left edge sits on node index, or false if it leaves the page
+static bool skyline_fit(const SkylinePacker* packer, size_t index, uint32_t width, uint32_t height, uint32_t* y)
+{
+    uint32_t x = packer->skyline[index].x;
+    if (x + width > packer->width) {
+        return false;
+    }
+
+    uint32_t top = 0;
+    uint32_t width_left = width;
+    for (size_t i = index; width_left > 0; ++i) {
+        if (i == packer->skyline.size()) {
+            return false;
+        }
+        top = std::max(top, packer->skyline[i].y);
+        if (top + height > packer->height) {
+            return false;
+        }
+        width_left -= std::min(width_left, packer->skyline[i].width);
+    }
+
+    *y = top;
+    return true;
+}
+
+bool skyline_pack(SkylinePacker* packer, uint32_t width, uint32_t height, uint32_t* x, uint32_t* y)
+{
+    // Lowest resulting top edge wins, ties go to the narrower node to keep gaps small
+    size_t best_index = packer->skyline.size();
+    uint32_t best_bottom = 0xFFFFFFFF;
+    uint32_t best_width = 0xFFFFFFFF;
+    uint32_t best_y = 0;
+    for (size_t i = 0; i < packer->skyline.size(); ++i) {
+        uint32_t top;
+        if (!skyline_fit(packer, i, width, height, &top)) {
+            continue;
+        }
+        if (top + height < best_bottom || (top + height == best_bottom && packer->skyline[i].width < best_width)) {
+            best_index = i;
+            best_bottom = top + height;
+            best_width = packer->skyline[i].width;
+            best_y = top;
+        }
+    }
+    if (best_index == packer->skyline.size()) {
+        return false;
+    }
+
+    SkylineNode node = { packer->skyline[best_index].x, best_y + height, width };
+    packer->skyline.insert(packer->skyline.begin() + best_index, node);
+
+    // Trim or drop the nodes now covered by the new one
+    for (size_t i = best_index + 1; i < packer->skyline.size(); ) {
+        SkylineNode& next = packer->skyline[i];
+        uint32_t covered_to = node.x + node.width;
+        if (next.x >= covered_to) {
+            break;
+        }
+        uint32_t shrink = covered_to - next.x;
+        if (shrink >= next.width) {
+            packer->skyline.erase(packer->skyline.begin() + i);
+            continue;
+        }
+        next.x += shrink;
+        next.width -= shrink;
+        break;
+    }
+
+    // Merge neighbours at the same height
+    for (size_t i = 0; i + 1 < packer->skyline.size(); ) {
+        if (packer->skyline[i].y == packer->skyline[i + 1].y) {
+            packer->skyline[i].width += packer->skyline[i + 1].width;
+            packer->skyline.erase(packer->skyline.begin() + i + 1);
+        }
+        else {
+            ++i;
+        }
+    }
+
+    packer->used_area += (uint64_t)width * height;
+    *x = node.x;
+    *y = best_y;
+    return true;
+}
+
+float skyline_efficiency(const SkylinePacker* packer)
+{
+    uint64_t area = (uint64_t)packer->width * packer->height;
+    return area > 0 ? (float)((double)packer->used_area / (double)area) : 0.0f;
+}
+
+static AtlasPage* add_atlas_page(CharacterAtlas* atlas, uint32_t width, uint32_t height)
+{
+    atlas->pages.emplace_back();
+    AtlasPage* page = &atlas->pages.back();
+    page->width = width;
+    page->height = height;
+    page->pixels.assign((size_t)width * height, 0);
+    skyline_init(&page->packer, width, height);
+    page->base_skyline = page->packer.skyline;
+    atlas->texture_bytes += (size_t)width * height;
+    return page;
+}
+
+static void update_packing_efficiency(CharacterAtlas* atlas)
+{
+    uint64_t used = 0;
+    uint64_t area = 0;
+    for (const auto& page : atlas->pages) {
+        used += page.ink_area;
+        area += (uint64_t)page.width * page.height;
+    }
+    atlas->packing_efficiency = area > 0 ? (float)((double)used / (double)area) : 0.0f;
+}
+
+// Drops every dynamic glyph on the page and rewinds its skyline to the pinned glyphs, if any
+static void evict_atlas_page(CharacterAtlas* atlas, uint32_t page_index)
+{
+    for (uint32_t i = 0; i < atlas->slots.size(); ++i) {
+        GlyphSlot& slot = atlas->slots[i];
+        if (slot.occupied && slot.character.page == page_index) {
+            glyph_table_erase(&atlas->table, slot.character.codepoint);
+            slot.occupied = false;
+            atlas->free_slots.push_back(i);
+            atlas->cache_stats.evictions++;
+        }
+    }
+
+    AtlasPage& page = atlas->pages[page_index];
+    page.packer.skyline = page.base_skyline;
+    page.packer.used_area = page.base_area;
+    page.ink_area = page.base_ink_area;
+    page.glyphs = 0;
+}
+
+// Finds room for a width by height rectangle on any page. Adds a page while under CLAY_GLYPH_MAX_PAGES, then evicts
+// the least recently used page not drawn this frame. Only when every page is drawn this frame does the atlas go past
+// the budget, so a glyph already queued for drawing is never discarded
+static bool pack_dynamic_glyph(CharacterAtlas* atlas, uint32_t width, uint32_t height, uint32_t frame, uint32_t* page_index, uint32_t* x, uint32_t* y)
+{
+    for (uint32_t i = 0; i < atlas->pages.size(); ++i) {
+        if (skyline_pack(&atlas->pages[i].packer, width, height, x, y)) {
+            *page_index = i;
+            return true;
+        }
+    }
+
+    if (atlas->pages.size() >= CLAY_GLYPH_MAX_PAGES) {
+        uint32_t oldest = GLYPH_TABLE_EMPTY;
+        for (uint32_t i = 0; i < atlas->pages.size(); ++i) {
+            const AtlasPage& page = atlas->pages[i];
+            if (page.glyphs > 0 && page.last_used != frame
+                && (oldest == GLYPH_TABLE_EMPTY || frame - page.last_used > frame - atlas->pages[oldest].last_used)) {
+                oldest = i;
+            }
+        }
+        if (oldest != GLYPH_TABLE_EMPTY) {
+            evict_atlas_page(atlas, oldest);
+            if (skyline_pack(&atlas->pages[oldest].packer, width, height, x, y)) {
+                *page_index = oldest;
+                return true;
+            }
+        }
+    }
+
+    // Square power of two CLAY_GLYPH_PAGE_EMS ems wide and at least as large as the glyph, or the largest texture GL allows
+    uint32_t em = atlas->pixel_size + 2 * (uint32_t)atlas->sdf_spread + 2;
+    uint32_t side = 64;
+    while ((side < CLAY_GLYPH_PAGE_EMS * em || side < std::max(width, height)) && side < atlas->max_texture_size) {
+        side *= 2;
+    }
+    side = std::min(side, atlas->max_texture_size);
+    if (width > side || height > side) {
+        return false;
+    }
+
+    AtlasPage* page = add_atlas_page(atlas, side, side);
+    *page_index = (uint32_t)atlas->pages.size() - 1;
+    return skyline_pack(&page->packer, width, height, x, y);
+}
+
+GlyphMetrics glyph_metrics(const CharacterAtlas* atlas, const Character& character)
+{
+    GlyphMetrics metrics = { 0.0f, 0.0f, 0.0f };
+    metrics.advance = atlas->sdf ? character.advance / 64.0f : (float)(character.advance >> 6);
+
+    // SDF bitmaps carry the spread around the glyph, measure the outline itself
+    float inset = character.size.x > 0 ? atlas->sdf_spread : 0.0f;
+    float w = std::max(0.0f, (float)character.size.x - 2.0f * inset);
+    float h = std::max(0.0f, (float)character.size.y - 2.0f * inset);
+    if (w > 0.0f || h > 0.0f) {
+        metrics.left = (float)character.bearing.x + inset;
+        metrics.right = metrics.left + w;
+    }
+    return metrics;
+}
+
+// Kerning between two codepoints from the face, atlas->size must be active
+static int16_t load_kerning(CharacterAtlas* atlas, uint32_t left, uint32_t right)
+{
+    FT_UInt left_index = FT_Get_Char_Index(atlas->face, left);
+    FT_UInt right_index = FT_Get_Char_Index(atlas->face, right);
+    FT_Vector delta;
+    if (left_index == 0 || right_index == 0 || FT_Get_Kerning(atlas->face, left_index, right_index, atlas->sdf ? FT_KERNING_UNFITTED : FT_KERNING_DEFAULT, &delta)) {
+        return 0;
+    }
+    return (int16_t)std::clamp<FT_Pos>(delta.x, INT16_MIN, INT16_MAX);
+}
+
+// Every ASCII pair up front, so measuring and laying out ASCII text never calls into FreeType
+static void init_ascii_kerning(CharacterAtlas* atlas)
+{
+    atlas->ascii_kerning.clear();
+    atlas->kerning_cache.clear();
+    if (!atlas->kerned) {
+        return;
+    }
+
+    FT_Activate_Size(atlas->size);
+    std::vector<int16_t> table(CLAY_GLYPH_PINNED_CODEPOINTS * CLAY_GLYPH_PINNED_CODEPOINTS, 0);
+    bool any = false;
+    for (uint32_t left = 0; left < CLAY_GLYPH_PINNED_CODEPOINTS; ++left) {
+        for (uint32_t right = 0; right < CLAY_GLYPH_PINNED_CODEPOINTS; ++right) {
+            int16_t value = load_kerning(atlas, left, right);
+            table[left * CLAY_GLYPH_PINNED_CODEPOINTS + right] = value;
+            any = any || value != 0;
+        }
+    }
+    if (any) {
+        atlas->ascii_kerning = std::move(table);
+    }
+}
+
+float glyph_kerning(CharacterAtlas* atlas, uint32_t left, uint32_t right)
+{
+    if (!atlas->kerned || left == CLAY_INVALID_CODEPOINT || right == CLAY_INVALID_CODEPOINT) {
+        return 0.0f;
+    }
+    if (left < CLAY_GLYPH_PINNED_CODEPOINTS && right < CLAY_GLYPH_PINNED_CODEPOINTS) {
+        return atlas->ascii_kerning.empty() ? 0.0f : atlas->ascii_kerning[left * CLAY_GLYPH_PINNED_CODEPOINTS + right] / 64.0f;
+    }
+
+    uint64_t key = ((uint64_t)left << 32) | right;
+    auto it = atlas->kerning_cache.find(key);
+    if (it != atlas->kerning_cache.end()) {
+        return it->second / 64.0f;
+    }
+    if (atlas->face == nullptr) {
+        return 0.0f;
+    }
+    FT_Activate_Size(atlas->size);
+    int16_t value = load_kerning(atlas, left, right);
+    atlas->kerning_cache.emplace(key, value);
+    return value / 64.0f;
+}
+
+static void init_ascii_metrics(CharacterAtlas* atlas)
+{
+    for (uint32_t i = 0; i < CLAY_GLYPH_PINNED_CODEPOINTS; ++i) {
+        atlas->ascii_metrics[i] = glyph_metrics(atlas, atlas->characters[i]);
+    }
+
+    float digit_advance = 0.0f;
+    for (uint32_t digit = '0'; digit <= '9'; ++digit) {
+        digit_advance = std::max(digit_advance, atlas->ascii_metrics[digit].advance);
+    }
+    for (uint32_t i = 0; i < CLAY_GLYPH_PINNED_CODEPOINTS; ++i) {
+        bool digit = i >= '0' && i <= '9';
+        atlas->numeric_advances[i] = digit ? digit_advance : atlas->ascii_metrics[i].advance;
+    }
+}
+
+// Slots and their page space are only allocated as glyphs arrive
+static void init_glyph_slots(CharacterAtlas* atlas)
+{
+    atlas->slots.clear();
+    atlas->free_slots.clear();
+    glyph_table_init(&atlas->table, 64);
+    atlas->cache_stats = {};
+}
+
+// Leaves the rendered glyph in face->glyph, outlines without points such as spaces only get metrics
+static bool load_glyph(CharacterAtlas* atlas, uint32_t codepoint)
+{
+    FT_Face face = atlas->face;
+    FT_Activate_Size(atlas->size);
+    if (!atlas->sdf) {
+        return FT_Load_Char(face, codepoint, FT_LOAD_RENDER) == 0;
+    }
+
+    // Unhinted so advances scale linearly with the font size
+    if (FT_Load_Char(face, codepoint, FT_LOAD_NO_HINTING)) {
+        return false;
+    }
+    if (face->glyph->format == FT_GLYPH_FORMAT_OUTLINE && face->glyph->outline.n_points == 0) {
+        return true;
     }
+    return FT_Render_Glyph(face->glyph, FT_RENDER_MODE_SDF) == 0;
+}
+
+// Metrics of the glyph load_glyph left in face->glyph, bounds are set once it is packed
+static Character loaded_character(const CharacterAtlas* atlas, uint32_t codepoint)
+{
+    FT_GlyphSlot slot = atlas->face->glyph;
+    Character character = {};
+    character.codepoint = codepoint;
+    character.bearing = glm::ivec2(slot->bitmap_left, slot->bitmap_top);
+    character.advance = slot->advance.x;
+    character.size = { slot->bitmap.width, slot->bitmap.rows };
+    character.bounds = { 0.0f, 0.0f, 0.0f, 0.0f };
+    character.page = 0;
+    return character;
+}
+
+// Copies the bitmap to left, top on page_index with a 1px border replicating its edge pixels, so the
+// packed rectangle is character->size plus 2 each way
+static void blit_glyph(CharacterAtlas* atlas, uint32_t page_index, uint32_t left, uint32_t top, const uint8_t* bitmap, int pitch, Character* character)
+{
+    AtlasPage* page = &atlas->pages[page_index];
+    uint32_t bitmap_width = character->size.x;
+    uint32_t bitmap_height = character->size.y;
+    uint32_t texture_width = page->width;
+    uint32_t texture_height = page->height;
+    uint8_t* pixels = page->pixels.data();
 
+    character->page = page_index;
+    character->bounds = {
+        (float)(left + 1) / texture_width,
+        (float)(left + 1 + bitmap_width) / texture_width,
+        (float)(top + 1) / texture_height,
+        (float)(top + 1 + bitmap_height) / texture_height,
+    };
+
+    for (uint32_t row = 0; row < bitmap_height; ++row) {
+        const uint8_t* src_row = bitmap + row * pitch;
+        uint8_t* dest = pixels + (top + 1 + row) * texture_width + left + 1;
+        memcpy(dest, src_row, bitmap_width);
+
+        dest[-1] = src_row[0];
+        dest[bitmap_width] = src_row[bitmap_width - 1];
+    }
+
+    const uint8_t* first_row = pixels + (top + 1) * texture_width + left;
+    const uint8_t* last_row = pixels + (top + bitmap_height) * texture_width + left;
+    memcpy(pixels + top * texture_width + left, first_row, bitmap_width + 2);
+    memcpy(pixels + (top + bitmap_height + 1) * texture_width + left, last_row, bitmap_width + 2);
+
+    page->ink_area += (uint64_t)bitmap_width * bitmap_height;
+    mark_dirty(page, top, top + bitmap_height + 2);
+}
+
+int build_character_atlas(CharacterAtlas* atlas, FT_Face face, uint16_t font_size, bool sdf, uint32_t max_texture_size)
+{
+    FT_Size size;
+    if (FT_New_Size(face, &size))
+    {
+        std::cout << "ERROR::FREETYPE: Failed to create a font size" << std::endl;
+        return -1;
+    }
+    FT_Activate_Size(size);
     FT_Set_Pixel_Sizes(face, 0, font_size);
 
+    atlas->face = face;
+    atlas->size = size;
+    atlas->sdf = sdf;
+    atlas->pixel_size = font_size;
+    atlas->sdf_spread = sdf ? (float)CLAY_FONT_SDF_SPREAD : 0.0f;
+
     float metric_scale = 1.0f / 64.0f;
     atlas->ascender = std::max(0.0f, face->size->metrics.ascender * metric_scale);
     atlas->descender = std::max(0.0f, -face->size->metrics.descender * metric_scale);
@@ -38,208 +525,705 @@ int create_character_atlas(CharacterAtlas* atlas, std::string font_filepath, uin
     {
         atlas->line_height = atlas->ascender + atlas->descender;
     }
-    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
-
-    // Limit to ASCII 0-127 for now to avoid oversized textures
-    const uint32_t max_codepoint = 127;
-    atlas->characters.resize(max_codepoint + 1);
 
-    // Calculate total width and height needed for texture
-    uint32_t texture_height = 0;
-    uint32_t texture_width = 0;
-    for (uint32_t charcode = 0; charcode <= max_codepoint; ++charcode) {
-        if (FT_Load_Char(face, charcode, FT_LOAD_RENDER)) {
+    // Each pinned glyph is rendered once, its bitmap is kept until the page size is known
+    atlas->characters.assign(CLAY_GLYPH_PINNED_CODEPOINTS, Character{});
+    std::vector<uint32_t> pinned;
+    std::vector<glm::ivec2> pinned_sizes(CLAY_GLYPH_PINNED_CODEPOINTS, glm::ivec2(0, 0));
+    std::vector<std::vector<uint8_t>> pinned_bitmaps(CLAY_GLYPH_PINNED_CODEPOINTS);
+    for (uint32_t charcode = 0; charcode < CLAY_GLYPH_PINNED_CODEPOINTS; ++charcode) {
+        if (!load_glyph(atlas, charcode)) {
             continue;
         }
+        atlas->characters[charcode] = loaded_character(atlas, charcode);
+        const FT_Bitmap& bitmap = face->glyph->bitmap;
+        if (bitmap.width > 0 && bitmap.rows > 0) {
+            pinned.push_back(charcode);
+            pinned_sizes[charcode] = glm::ivec2(bitmap.width + 2, bitmap.rows + 2);
+            std::vector<uint8_t>& pixels = pinned_bitmaps[charcode];
+            pixels.resize((size_t)bitmap.width * bitmap.rows);
+            for (uint32_t row = 0; row < bitmap.rows; ++row) {
+                memcpy(pixels.data() + row * bitmap.width, bitmap.buffer + row * bitmap.pitch, bitmap.width);
+            }
+        }
+    }
+
+    // Tallest first keeps the skyline flat
+    std::sort(pinned.begin(), pinned.end(), [&](uint32_t a, uint32_t b) {
+        return pinned_sizes[a].y != pinned_sizes[b].y ? pinned_sizes[a].y > pinned_sizes[b].y : pinned_sizes[a].x > pinned_sizes[b].x;
+    });
+
+    // Smallest near square power of two page holding every pinned glyph, dynamic glyphs fill what is left and
+    // further pages as they arrive
+    uint32_t texture_width = 64;
+    uint32_t texture_height = 64;
+    SkylinePacker packer;
+    std::vector<glm::ivec2> pinned_origins(CLAY_GLYPH_PINNED_CODEPOINTS);
+    while (true) {
+        if (texture_width > max_texture_size || texture_height > max_texture_size) {
+            std::cout << "ERROR: Invalid texture dimensions for atlas" << std::endl;
+            FT_Done_Size(size);
+            atlas->face = nullptr;
+            atlas->size = nullptr;
+            return -1;
+        }
+
+        skyline_init(&packer, texture_width, texture_height);
+        bool fits = true;
+        for (size_t i = 0; i < pinned.size() && fits; ++i) {
+            uint32_t x, y;
+            glm::ivec2 size = pinned_sizes[pinned[i]];
+            fits = skyline_pack(&packer, size.x, size.y, &x, &y);
+            pinned_origins[pinned[i]] = glm::ivec2(x, y);
+        }
+        if (fits) {
+            break;
+        }
 
-        uint32_t bitmap_width = face->glyph->bitmap.width;
-        uint32_t bitmap_height = face->glyph->bitmap.rows;
-        uint32_t padded_width = (bitmap_width > 0 ? bitmap_width + 2 : 2); // border on left/right
-        texture_height += (bitmap_height > 0 ? bitmap_height + 2 : 2); // glyph pixels plus top/bottom borders
-        texture_width = std::max(padded_width, texture_width);
+        if (texture_height < texture_width) {
+            texture_height *= 2;
+        }
+        else {
+            texture_width *= 2;
+        }
     }
 
-    if (texture_width == 0) {
-        texture_width = 2;
+    atlas->max_texture_size = max_texture_size;
+    atlas->pages.clear();
+    atlas->texture_bytes = 0;
+    AtlasPage* page = add_atlas_page(atlas, texture_width, texture_height);
+    page->packer = packer;
+    page->base_skyline = packer.skyline;
+    page->base_area = packer.used_area;
+
+    for (uint32_t charcode : pinned) {
+        glm::ivec2 origin = pinned_origins[charcode];
+        Character* character = &atlas->characters[charcode];
+        blit_glyph(atlas, 0, origin.x, origin.y, pinned_bitmaps[charcode].data(), character->size.x, character);
+    }
+    page->base_ink_area = page->ink_area;
+    update_packing_efficiency(atlas);
+    init_ascii_metrics(atlas);
+    atlas->kerned = FT_HAS_KERNING(face);
+    init_ascii_kerning(atlas);
+
+    init_glyph_slots(atlas);
+
+    return 0;
+}
+
+int finish_character_atlas(CharacterAtlas* atlas, FontFace* font)
+{
+    if (atlas->characters.empty() || !font || !font->face)
+    {
+        return -1;
     }
-    if (texture_height == 0) {
-        texture_height = 2;
+
+    // Built on a worker's face, glyphs loaded from now on come from the shared one
+    if (atlas->face != font->face)
+    {
+        FT_Size size;
+        if (FT_New_Size(font->face, &size))
+        {
+            std::cout << "ERROR::FREETYPE: Failed to create a size for " + font->filepath << std::endl;
+            return -1;
+        }
+        FT_Activate_Size(size);
+        FT_Set_Pixel_Sizes(font->face, 0, atlas->pixel_size);
+        atlas->face = font->face;
+        atlas->size = size;
+    }
+    atlas->font = font;
+    atlas->kerned = FT_HAS_KERNING(font->face);
+
+    GLint max_texture_size;
+    glGetIntegerv(GL_MAX_TEXTURE_SIZE, &max_texture_size);
+    atlas->max_texture_size = static_cast<uint32_t>(max_texture_size);
+
+    // Save to file
+    std::string png_filepath = font->filepath + "_" + std::to_string(atlas->pixel_size) + ".png";
+    // stbi_write_png(png_filepath.c_str(), atlas->pages[0].width, atlas->pages[0].height, 1, atlas->pages[0].pixels.data(), atlas->pages[0].width);
+
+    // Dynamic slots start empty and are written as glyphs are rasterized into them
+    uint32_t glyph_count = (uint32_t)(atlas->characters.size() + atlas->slots.size());
+    atlas->instance_metrics.assign(glyph_count * 2, glm::vec4(0.0f));
+    for (uint32_t i = 0; i < atlas->characters.size(); ++i) {
+        write_instance_metrics(atlas, i, atlas->characters[i]);
+    }
+    for (uint32_t i = 0; i < atlas->slots.size(); ++i) {
+        if (atlas->slots[i].occupied) {
+            write_instance_metrics(atlas, (uint32_t)atlas->characters.size() + i, atlas->slots[i].character);
+        }
+    }
+
+    grow_character_atlas(atlas);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    glBindTexture(GL_TEXTURE_BUFFER, 0);
+
+    checkOpenGLErrors("Character atlas creation");
+
+    return 0;
+}
+
+int create_character_atlas(CharacterAtlas* atlas, FontFace* font, uint16_t font_size, bool sdf)
+{
+    if (!font || !font->face)
+    {
+        return -1;
     }
 
-    // Diagnostic: Query and log GL_MAX_TEXTURE_SIZE
     GLint gl_max_texture_size;
     glGetIntegerv(GL_MAX_TEXTURE_SIZE, &gl_max_texture_size);
-    // std::cout << "Font: " << font_filepath << ", Size: " << font_size
-    //           << ", Calculated texture: " << texture_width << "x" << texture_height
-    //           << ", GL_MAX_TEXTURE_SIZE: " << gl_max_texture_size << std::endl;
-
-    if (texture_width == 0 || texture_height == 0 || texture_width > static_cast<uint32_t>(gl_max_texture_size) || texture_height > static_cast<uint32_t>(gl_max_texture_size)) {
-        std::cout << "ERROR: Invalid texture dimensions for atlas" << std::endl;
-        FT_Done_Face(face);
-        FT_Done_FreeType(ft);
+
+    if (build_character_atlas(atlas, font->face, font_size, sdf, static_cast<uint32_t>(gl_max_texture_size)))
+    {
         return -1;
     }
+    return finish_character_atlas(atlas, font);
+}
 
-    // Fill texture
-    std::vector<uint8_t> texture(texture_width * texture_height, 0);
-    uint32_t current_row = 0;
-    for (uint32_t charcode = 0; charcode <= max_codepoint; ++charcode) {
-        if (FT_Load_Char(face, charcode, FT_LOAD_RENDER)) {
-            continue;
-        }
+// Baked atlas file, every field little endian as written by the running machine:
+// BakedAtlasHeader, character_count BakedCharacter, skyline_count SkylineNode of page 0 after the pinned glyphs,
+// kerning_count BakedKerningPair, then the bitmap of page 0
+struct BakedAtlasHeader
+{
+    char magic[4];
+    uint32_t version;
+    uint64_t key;
+    uint32_t pixel_size;
+    uint32_t sdf;
+    float sdf_spread;
+    float ascender;
+    float descender;
+    float line_height;
+    uint32_t texture_width;
+    uint32_t texture_height;
+    uint32_t character_count;
+    uint32_t skyline_count;
+    uint32_t kerning_count;
+};
 
-        uint32_t bitmap_width = face->glyph->bitmap.width;
-        uint32_t bitmap_height = face->glyph->bitmap.rows;
+struct BakedCharacter
+{
+    uint32_t codepoint;
+    float bounds[4]; // left, right, top, bot
+    int32_t bearing[2];
+    int32_t size[2];
+    uint32_t advance;
+};
 
-        Character character;
-        character.codepoint = charcode;
-        character.bearing = glm::ivec2(face->glyph->bitmap_left, face->glyph->bitmap_top);
-        character.advance = face->glyph->advance.x;
-        character.size = { bitmap_width, bitmap_height };
+// Nonzero entry of CharacterAtlas::ascii_kerning
+struct BakedKerningPair
+{
+    uint8_t left;
+    uint8_t right;
+    int16_t value;
+};
 
-        uint32_t block_height = (bitmap_height > 0 ? bitmap_height + 2 : 2);
-        uint32_t row_top = current_row;
-        if (bitmap_width == 0 || bitmap_height == 0)
-        {
-            character.bounds = { 0.0f, 0.0f, 0.0f, 0.0f };
+static const char CLAY_BAKED_ATLAS_MAGIC[4] = { 'C', 'L', 'A', 'T' };
+
+uint64_t baked_atlas_key(const FontFace* font, uint16_t font_size, bool sdf)
+{
+    // Anything that changes the rasterized pixels or the page layout
+    uint32_t settings[] = {
+        CLAY_BAKED_ATLAS_VERSION,
+        font_size,
+        sdf ? 1u : 0u,
+        sdf ? (uint32_t)CLAY_FONT_SDF_SPREAD : 0u,
+        CLAY_GLYPH_PINNED_CODEPOINTS,
+        FREETYPE_MAJOR,
+        FREETYPE_MINOR,
+        FREETYPE_PATCH,
+    };
+    return hash_bytes(settings, sizeof(settings), font->content_hash);
+}
+
+int save_baked_atlas(const CharacterAtlas* atlas, const std::string& filepath, uint64_t key)
+{
+    if (atlas->characters.empty() || atlas->pages.empty()) {
+        return -1;
+    }
+    const AtlasPage& page = atlas->pages[0];
+
+    BakedAtlasHeader header = {};
+    memcpy(header.magic, CLAY_BAKED_ATLAS_MAGIC, sizeof(header.magic));
+    header.version = CLAY_BAKED_ATLAS_VERSION;
+    header.key = key;
+    header.pixel_size = atlas->pixel_size;
+    header.sdf = atlas->sdf ? 1 : 0;
+    header.sdf_spread = atlas->sdf_spread;
+    header.ascender = atlas->ascender;
+    header.descender = atlas->descender;
+    header.line_height = atlas->line_height;
+    header.texture_width = page.width;
+    header.texture_height = page.height;
+    header.character_count = (uint32_t)atlas->characters.size();
+    header.skyline_count = (uint32_t)page.base_skyline.size();
+
+    std::vector<BakedCharacter> characters(atlas->characters.size());
+    for (size_t i = 0; i < atlas->characters.size(); ++i) {
+        const Character& ch = atlas->characters[i];
+        characters[i] = {
+            ch.codepoint,
+            { ch.bounds.left, ch.bounds.right, ch.bounds.top, ch.bounds.bot },
+            { ch.bearing.x, ch.bearing.y },
+            { ch.size.x, ch.size.y },
+            ch.advance,
+        };
+    }
+
+    std::vector<BakedKerningPair> kerning;
+    for (uint32_t i = 0; i < atlas->ascii_kerning.size(); ++i) {
+        if (atlas->ascii_kerning[i] != 0) {
+            kerning.push_back({ (uint8_t)(i / CLAY_GLYPH_PINNED_CODEPOINTS), (uint8_t)(i % CLAY_GLYPH_PINNED_CODEPOINTS), atlas->ascii_kerning[i] });
         }
-        else
-        {
-            character.bounds = {
-                1.0f / texture_width,
-                (float)(1 + bitmap_width) / texture_width,
-                (float)(row_top + 1) / texture_height,
-                (float)(row_top + 1 + bitmap_height) / texture_height,
-            };
-
-            const unsigned char* glyph_buffer = face->glyph->bitmap.buffer;
-
-            for (uint32_t row = 0; row < bitmap_height; ++row) {
-                const unsigned char* src_row = glyph_buffer + row * bitmap_width;
-                uint8_t* dest = texture.data() + (row_top + 1 + row) * texture_width + 1;
-                memcpy(dest, src_row, bitmap_width);
-
-                dest[-1] = src_row[0];
-                dest[bitmap_width] = src_row[bitmap_width - 1];
-            }
+    }
+    header.kerning_count = (uint32_t)kerning.size();
 
-            const unsigned char* first_row = glyph_buffer;
-            const unsigned char* last_row = glyph_buffer + (bitmap_height - 1) * bitmap_width;
-            uint8_t* top_row = texture.data() + row_top * texture_width + 1;
-            uint8_t* bottom_row = texture.data() + (row_top + bitmap_height + 1) * texture_width + 1;
-            memcpy(top_row, first_row, bitmap_width);
-            memcpy(bottom_row, last_row, bitmap_width);
+    // Written beside the target and renamed so a reader never maps a half written file
+    std::string temp_filepath = filepath + ".tmp";
+    {
+        std::ofstream file(temp_filepath, std::ios::binary | std::ios::trunc);
+        if (!file) {
+            return -1;
+        }
+        file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        file.write(reinterpret_cast<const char*>(characters.data()), characters.size() * sizeof(BakedCharacter));
+        file.write(reinterpret_cast<const char*>(page.base_skyline.data()), page.base_skyline.size() * sizeof(SkylineNode));
+        file.write(reinterpret_cast<const char*>(kerning.data()), kerning.size() * sizeof(BakedKerningPair));
+        file.write(reinterpret_cast<const char*>(page.pixels.data()), page.pixels.size());
+        if (!file) {
+            return -1;
+        }
+    }
 
-            top_row[-1] = first_row[0];
-            top_row[bitmap_width] = first_row[bitmap_width - 1];
-            bottom_row[-1] = last_row[0];
-            bottom_row[bitmap_width] = last_row[bitmap_width - 1];
+    std::error_code error;
+    std::filesystem::rename(temp_filepath, filepath, error);
+    if (error) {
+        std::filesystem::remove(temp_filepath, error);
+        return -1;
+    }
+    return 0;
+}
+
+// Dynamic glyphs are later packed against the skyline, so a tampered or damaged file must not place any rect off the page
+static bool baked_layout_inside(const BakedAtlasHeader& header, const uint8_t* characters, const uint8_t* skyline)
+{
+    uint32_t width = header.texture_width;
+    uint32_t height = header.texture_height;
+    if (width == 0 || height == 0) {
+        return false;
+    }
+
+    for (uint32_t i = 0; i < header.character_count; ++i) {
+        BakedCharacter baked;
+        memcpy(&baked, characters + i * sizeof(BakedCharacter), sizeof(baked));
+        const float* bounds = baked.bounds; // left, right, top, bot, NaN fails every comparison
+        bool inside = bounds[0] >= 0.0f && bounds[0] <= bounds[1] && bounds[1] <= 1.0f
+            && bounds[2] >= 0.0f && bounds[2] <= bounds[3] && bounds[3] <= 1.0f
+            && baked.size[0] >= 0 && (uint32_t)baked.size[0] <= width
+            && baked.size[1] >= 0 && (uint32_t)baked.size[1] <= height;
+        if (!inside) {
+            return false;
         }
+    }
 
-        atlas->characters[charcode] = character;
+    // Left to right without gaps across the whole width
+    uint32_t x = 0;
+    for (uint32_t i = 0; i < header.skyline_count; ++i) {
+        SkylineNode node;
+        memcpy(&node, skyline + i * sizeof(SkylineNode), sizeof(node));
+        if (node.x != x || node.width == 0 || node.width > width - x || node.y > height) {
+            return false;
+        }
+        x += node.width;
+    }
+    return x == width;
+}
 
-        current_row += block_height;
+int load_baked_atlas(CharacterAtlas* atlas, const std::string& filepath, uint64_t key)
+{
+    MappedFile file;
+    if (!map_file(&file, filepath)) {
+        return -1;
+    }
+
+    BakedAtlasHeader header = {};
+    bool valid = file.size >= sizeof(header);
+    if (valid) {
+        memcpy(&header, file.data, sizeof(header));
+        valid = memcmp(header.magic, CLAY_BAKED_ATLAS_MAGIC, sizeof(header.magic)) == 0
+            && header.version == CLAY_BAKED_ATLAS_VERSION
+            && header.key == key
+            && header.character_count == CLAY_GLYPH_PINNED_CODEPOINTS
+            && header.skyline_count > 0
+            && header.skyline_count <= header.texture_width
+            && header.kerning_count <= CLAY_GLYPH_PINNED_CODEPOINTS * CLAY_GLYPH_PINNED_CODEPOINTS;
     }
-    
-    // Save to file
-    std::string png_filepath = font_filepath + "_" + std::to_string(font_size) + ".png";
-    // stbi_write_png(png_filepath.c_str(), texture_width, texture_height, 1, texture.data(), texture_width);
-
-    // Upload texture
-    uint32_t texture_id;
-    glGenTextures(1, &texture_id);
-    glBindTexture(GL_TEXTURE_2D, texture_id);
-    glTexImage2D(
-        GL_TEXTURE_2D,
-        0,
-        GL_RED,
-        texture_width,
-        texture_height,
-        0,
-        GL_RED,
-        GL_UNSIGNED_BYTE,
-        texture.data()
-    );
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    glBindTexture(GL_TEXTURE_2D, 0);
 
-    atlas->texture_id = texture_id;
+    size_t characters_offset = sizeof(header);
+    size_t skyline_offset = characters_offset + (size_t)header.character_count * sizeof(BakedCharacter);
+    size_t kerning_offset = skyline_offset + (size_t)header.skyline_count * sizeof(SkylineNode);
+    size_t pixels_offset = kerning_offset + (size_t)header.kerning_count * sizeof(BakedKerningPair);
+    size_t pixels_size = (size_t)header.texture_width * header.texture_height;
+    valid = valid && file.size == pixels_offset + pixels_size && baked_layout_inside(header, file.data + characters_offset, file.data + skyline_offset);
+    if (!valid) {
+        unmap_file(&file);
+        return -1;
+    }
 
-    FT_Done_Face(face);
-    FT_Done_FreeType(ft);
+    atlas->face = nullptr;
+    atlas->size = nullptr;
+    atlas->sdf = header.sdf != 0;
+    atlas->pixel_size = (uint16_t)header.pixel_size;
+    atlas->sdf_spread = header.sdf_spread;
+    atlas->ascender = header.ascender;
+    atlas->descender = header.descender;
+    atlas->line_height = header.line_height;
 
-    checkOpenGLErrors("Character atlas creation");
+    atlas->characters.resize(header.character_count);
+    for (uint32_t i = 0; i < header.character_count; ++i) {
+        BakedCharacter baked;
+        memcpy(&baked, file.data + characters_offset + i * sizeof(BakedCharacter), sizeof(baked));
+        Character& ch = atlas->characters[i];
+        ch.codepoint = baked.codepoint;
+        ch.bounds = { baked.bounds[0], baked.bounds[1], baked.bounds[2], baked.bounds[3] };
+        ch.bearing = glm::ivec2(baked.bearing[0], baked.bearing[1]);
+        ch.size = glm::ivec2(baked.size[0], baked.size[1]);
+        ch.advance = baked.advance;
+        ch.page = 0;
+    }
+    init_ascii_metrics(atlas);
+
+    // Pinned glyphs cover their bitmap and its border, as packed by build_character_atlas
+    atlas->pages.clear();
+    atlas->texture_bytes = 0;
+    AtlasPage* page = add_atlas_page(atlas, header.texture_width, header.texture_height);
+    page->base_skyline.resize(header.skyline_count);
+    memcpy(page->base_skyline.data(), file.data + skyline_offset, header.skyline_count * sizeof(SkylineNode));
+    for (const auto& ch : atlas->characters) {
+        if (ch.size.x > 0 && ch.size.y > 0) {
+            page->base_area += (uint64_t)(ch.size.x + 2) * (ch.size.y + 2);
+            page->base_ink_area += (uint64_t)ch.size.x * ch.size.y;
+        }
+    }
+    page->packer.skyline = page->base_skyline;
+    page->packer.used_area = page->base_area;
+    page->ink_area = page->base_ink_area;
+    update_packing_efficiency(atlas);
+    init_glyph_slots(atlas);
+
+    // Whether the face is kerned at all is known once finish_character_atlas attaches it
+    atlas->ascii_kerning.clear();
+    atlas->kerning_cache.clear();
+    for (uint32_t i = 0; i < header.kerning_count; ++i) {
+        BakedKerningPair pair;
+        memcpy(&pair, file.data + kerning_offset + i * sizeof(pair), sizeof(pair));
+        if (pair.left >= CLAY_GLYPH_PINNED_CODEPOINTS || pair.right >= CLAY_GLYPH_PINNED_CODEPOINTS) {
+            continue;
+        }
+        if (atlas->ascii_kerning.empty()) {
+            atlas->ascii_kerning.assign(CLAY_GLYPH_PINNED_CODEPOINTS * CLAY_GLYPH_PINNED_CODEPOINTS, 0);
+        }
+        atlas->ascii_kerning[pair.left * CLAY_GLYPH_PINNED_CODEPOINTS + pair.right] = pair.value;
+    }
+
+    page->pixels.assign(file.data + pixels_offset, file.data + pixels_offset + pixels_size);
+    unmap_file(&file);
 
     return 0;
 }
 
+const Character* get_character(CharacterAtlas* atlas, uint32_t codepoint, uint32_t frame, uint32_t* glyph_index)
+{
+    if (codepoint < atlas->characters.size()) {
+        if (glyph_index) {
+            *glyph_index = codepoint;
+        }
+        return &atlas->characters[codepoint];
+    }
 
+    uint32_t slot = glyph_table_find(&atlas->table, codepoint);
+    if (slot != GLYPH_TABLE_EMPTY) {
+        atlas->cache_stats.hits++;
+        atlas->slots[slot].last_used = frame;
+        atlas->pages[atlas->slots[slot].character.page].last_used = frame;
+        if (glyph_index) {
+            *glyph_index = (uint32_t)atlas->characters.size() + slot;
+        }
+        return &atlas->slots[slot].character;
+    }
 
-void utf8_to_codepoints(const std::string& text, std::vector<uint32_t>& codepoints) {
-    size_t i = 0;
-    while (i < text.length()) {
-        unsigned char byte = static_cast<unsigned char>(text[i]);
-        uint32_t codepoint = 0;
-        int bytes_consumed = 0;
-
-        if (byte < 0x80) {
-            // Single-byte (ASCII)
-            codepoint = byte;
-            bytes_consumed = 1;
-        } else if ((byte & 0xE0) == 0xC0) {
-            // Two-byte sequence
-            if (i + 1 >= text.length()) break;
-            unsigned char byte2 = static_cast<unsigned char>(text[i + 1]);
-            if ((byte2 & 0xC0) != 0x80) { ++i; continue; } // Invalid continuation
-            codepoint = ((byte & 0x1F) << 6) | (byte2 & 0x3F);
-            bytes_consumed = 2;
-        } else if ((byte & 0xF0) == 0xE0) {
-            // Three-byte sequence
-            if (i + 2 >= text.length()) break;
-            unsigned char byte2 = static_cast<unsigned char>(text[i + 1]);
-            unsigned char byte3 = static_cast<unsigned char>(text[i + 2]);
-            if ((byte2 & 0xC0) != 0x80 || (byte3 & 0xC0) != 0x80) { ++i; continue; } // Invalid
-            codepoint = ((byte & 0x0F) << 12) | ((byte2 & 0x3F) << 6) | (byte3 & 0x3F);
-            bytes_consumed = 3;
-        } else if ((byte & 0xF8) == 0xF0) {
-            // Four-byte sequence
-            if (i + 3 >= text.length()) break;
-            unsigned char byte2 = static_cast<unsigned char>(text[i + 1]);
-            unsigned char byte3 = static_cast<unsigned char>(text[i + 2]);
-            unsigned char byte4 = static_cast<unsigned char>(text[i + 3]);
-            if ((byte2 & 0xC0) != 0x80 || (byte3 & 0xC0) != 0x80 || (byte4 & 0xC0) != 0x80) { ++i; continue; } // Invalid
-            codepoint = ((byte & 0x07) << 18) | ((byte2 & 0x3F) << 12) | ((byte3 & 0x3F) << 6) | (byte4 & 0x3F);
-            bytes_consumed = 4;
-        } else {
-            // Invalid leading byte
-            ++i;
-            continue;
+    atlas->cache_stats.misses++;
+    if (atlas->face == nullptr) {
+        atlas->cache_stats.failures++;
+        return nullptr;
+    }
+
+    if (!load_glyph(atlas, codepoint)) {
+        atlas->cache_stats.failures++;
+        return nullptr;
+    }
+
+    if (!atlas->free_slots.empty()) {
+        slot = atlas->free_slots.back();
+        atlas->free_slots.pop_back();
+    }
+    else if (atlas->characters.size() + atlas->slots.size() < CLAY_GLYPH_MAX_INDEX) {
+        slot = (uint32_t)atlas->slots.size();
+        atlas->slots.push_back({});
+    }
+    else {
+        atlas->cache_stats.failures++;
+        return nullptr;
+    }
+
+    // Packed at its own size plus the border, glyphs without ink such as spaces take no room
+    GlyphSlot* glyph = &atlas->slots[slot];
+    glyph->character = loaded_character(atlas, codepoint);
+    if (glyph->character.size.x > 0 && glyph->character.size.y > 0) {
+        uint32_t page_index, x, y;
+        if (!pack_dynamic_glyph(atlas, glyph->character.size.x + 2, glyph->character.size.y + 2, frame, &page_index, &x, &y)) {
+            atlas->free_slots.push_back(slot);
+            atlas->cache_stats.failures++;
+            return nullptr;
         }
+        FT_Bitmap* bitmap = &atlas->face->glyph->bitmap;
+        blit_glyph(atlas, page_index, x, y, bitmap->buffer, bitmap->pitch, &glyph->character);
+        atlas->pages[page_index].glyphs++;
+        update_packing_efficiency(atlas);
+    }
+    glyph->last_used = frame;
+    glyph->occupied = true;
+    atlas->pages[glyph->character.page].last_used = frame;
+    glyph_table_insert(&atlas->table, codepoint, slot);
 
-        i += bytes_consumed;
+    uint32_t index = (uint32_t)atlas->characters.size() + slot;
+    write_instance_metrics(atlas, index, glyph->character);
+    if (glyph_index) {
+        *glyph_index = index;
+    }
+
+    return &glyph->character;
+}
+
+bool atlas_page_dirty(const AtlasPage* page)
+{
+    return page->dirty_bot > page->dirty_top;
+}
+
+bool character_atlas_dirty(const CharacterAtlas* atlas)
+{
+    for (const auto& page : atlas->pages) {
+        if (atlas_page_dirty(&page)) {
+            return true;
+        }
+    }
+    return atlas->metrics_dirty_last > atlas->metrics_dirty_first;
+}
 
-        // Optional: Validate codepoint range (e.g., skip surrogates or invalid)
-        if (codepoint > 0x10FFFF || (codepoint >= 0xD800 && codepoint <= 0xDFFF)) {
+bool grow_character_atlas(CharacterAtlas* atlas)
+{
+    bool bound = false;
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    for (auto& page : atlas->pages) {
+        if (page.texture_id != 0) {
             continue;
         }
+        glGenTextures(1, &page.texture_id);
+        glBindTexture(GL_TEXTURE_2D, page.texture_id);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RED, page.width, page.height, 0, GL_RED, GL_UNSIGNED_BYTE, page.pixels.data());
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        page.dirty_top = 0;
+        page.dirty_bot = 0;
+        bound = true;
+    }
+
+    uint32_t texels = (uint32_t)atlas->instance_metrics.size();
+    if (texels <= atlas->metrics_capacity) {
+        return bound;
+    }
 
-        codepoints.push_back(codepoint);
+    // Doubles so a burst of new glyphs reallocates a handful of times, every texel is sent again
+    atlas->metrics_capacity = std::max(texels, atlas->metrics_capacity * 2);
+    if (atlas->metrics_buffer == 0) {
+        glGenBuffers(1, &atlas->metrics_buffer);
+        glGenTextures(1, &atlas->metrics_texture);
     }
+    glBindBuffer(GL_TEXTURE_BUFFER, atlas->metrics_buffer);
+    glBufferData(GL_TEXTURE_BUFFER, atlas->metrics_capacity * sizeof(glm::vec4), nullptr, GL_DYNAMIC_DRAW);
+    glBufferSubData(GL_TEXTURE_BUFFER, 0, texels * sizeof(glm::vec4), atlas->instance_metrics.data());
+    glBindTexture(GL_TEXTURE_BUFFER, atlas->metrics_texture);
+    glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, atlas->metrics_buffer);
+    atlas->metrics_dirty_first = 0;
+    atlas->metrics_dirty_last = 0;
+    return true;
 }
 
+void upload_instance_metrics(CharacterAtlas* atlas)
+{
+    if (atlas->metrics_dirty_last <= atlas->metrics_dirty_first) {
+        return;
+    }
 
+    uint32_t first = atlas->metrics_dirty_first * 2;
+    uint32_t count = (atlas->metrics_dirty_last - atlas->metrics_dirty_first) * 2;
+    glBindBuffer(GL_TEXTURE_BUFFER, atlas->metrics_buffer);
+    glBufferSubData(GL_TEXTURE_BUFFER, first * sizeof(glm::vec4), count * sizeof(glm::vec4), atlas->instance_metrics.data() + first);
+    atlas->metrics_dirty_first = 0;
+    atlas->metrics_dirty_last = 0;
+}
 
+void upload_atlas_page(CharacterAtlas* atlas, uint32_t page_index)
+{
+    AtlasPage* page = &atlas->pages[page_index];
+    if (!atlas_page_dirty(page)) {
+        return;
+    }
 
+#ifndef NDEBUG
+    GLint bound = 0;
+    glGetIntegerv(GL_TEXTURE_BINDING_2D, &bound);
+    assert(static_cast<uint32_t>(bound) == page->texture_id && "upload_atlas_page needs the page bound to the active unit");
+#endif
 
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glTexSubImage2D(
+        GL_TEXTURE_2D,
+        0,
+        0,
+        page->dirty_top,
+        page->width,
+        page->dirty_bot - page->dirty_top,
+        GL_RED,
+        GL_UNSIGNED_BYTE,
+        page->pixels.data() + page->dirty_top * page->width
+    );
+    page->dirty_top = 0;
+    page->dirty_bot = 0;
+}
 
 
 
+uint32_t next_codepoint(const char* text, size_t length, size_t* offset)
+{
+    const unsigned char* bytes = reinterpret_cast<const unsigned char*>(text);
+    size_t i = *offset;
+    unsigned char byte = bytes[i];
 
+    uint32_t codepoint;
+    size_t count;
+    if (byte < 0x80) {
+        *offset = i + 1;
+        return byte;
+    } else if ((byte & 0xE0) == 0xC0) {
+        codepoint = byte & 0x1F;
+        count = 2;
+    } else if ((byte & 0xF0) == 0xE0) {
+        codepoint = byte & 0x0F;
+        count = 3;
+    } else if ((byte & 0xF8) == 0xF0) {
+        codepoint = byte & 0x07;
+        count = 4;
+    } else {
+        *offset = i + 1;
+        return CLAY_INVALID_CODEPOINT;
+    }
 
+    if (i + count > length) {
+        *offset = length;
+        return CLAY_INVALID_CODEPOINT;
+    }
+    for (size_t k = 1; k < count; ++k) {
+        if ((bytes[i + k] & 0xC0) != 0x80) {
+            *offset = i + 1;
+            return CLAY_INVALID_CODEPOINT;
+        }
+        codepoint = (codepoint << 6) | (bytes[i + k] & 0x3F);
+    }
 
+    *offset = i + count;
+    if (codepoint > 0x10FFFF || (codepoint >= 0xD800 && codepoint <= 0xDFFF)) {
+        return CLAY_INVALID_CODEPOINT;
+    }
+    return codepoint;
+}
 
+size_t decode_utf8(const char* text, size_t length, uint32_t* codepoints)
+{
+    const uint8_t* bytes = reinterpret_cast<const uint8_t*>(text);
+    size_t i = 0;
+    size_t count = 0;
 
+    while (i < length) {
+        // Widen whole blocks while they are pure ASCII, the first block with a high bit set drops to scalar
+#if defined(CLAY_UTF8_AVX2)
+        while (i + 32 <= length) {
+            __m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(bytes + i));
+            if (_mm256_movemask_epi8(chunk)) {
+                break;
+            }
+            for (size_t k = 0; k < 32; k += 8) {
+                __m256i wide = _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(bytes + i + k)));
+                _mm256_storeu_si256(reinterpret_cast<__m256i*>(codepoints + count + k), wide);
+            }
+            i += 32;
+            count += 32;
+        }
+#endif
+#if defined(CLAY_UTF8_SSE2)
+        while (i + 16 <= length) {
+            __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(bytes + i));
+            if (_mm_movemask_epi8(chunk)) {
+                break;
+            }
+            __m128i zero = _mm_setzero_si128();
+            __m128i lo = _mm_unpacklo_epi8(chunk, zero);
+            __m128i hi = _mm_unpackhi_epi8(chunk, zero);
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(codepoints + count), _mm_unpacklo_epi16(lo, zero));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(codepoints + count + 4), _mm_unpackhi_epi16(lo, zero));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(codepoints + count + 8), _mm_unpacklo_epi16(hi, zero));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(codepoints + count + 12), _mm_unpackhi_epi16(hi, zero));
+            i += 16;
+            count += 16;
+        }
+#elif defined(CLAY_UTF8_NEON)
+        while (i + 16 <= length) {
+            uint8x16_t chunk = vld1q_u8(bytes + i);
+            if (vmaxvq_u8(chunk) >= 0x80) {
+                break;
+            }
+            uint16x8_t lo = vmovl_u8(vget_low_u8(chunk));
+            uint16x8_t hi = vmovl_u8(vget_high_u8(chunk));
+            vst1q_u32(codepoints + count, vmovl_u16(vget_low_u16(lo)));
+            vst1q_u32(codepoints + count + 4, vmovl_u16(vget_high_u16(lo)));
+            vst1q_u32(codepoints + count + 8, vmovl_u16(vget_low_u16(hi)));
+            vst1q_u32(codepoints + count + 12, vmovl_u16(vget_high_u16(hi)));
+            i += 16;
+            count += 16;
+        }
+#endif
+
+        // Scalar through the block that stopped the fast lane, or the tail shorter than a block
+        size_t end = std::min(length, i + 16);
+        while (i < end) {
+            uint32_t codepoint = next_codepoint(text, length, &i);
+            if (codepoint != CLAY_INVALID_CODEPOINT) {
+                codepoints[count++] = codepoint;
+            }
+        }
+    }
+
+    return count;
+}
 
+void utf8_to_codepoints(const std::string& text, std::vector<uint32_t>& codepoints)
+{
+    size_t first = codepoints.size();
+    codepoints.resize(first + text.size());
+    size_t count = decode_utf8(text.data(), text.size(), codepoints.data() + first);
+    codepoints.resize(first + count);
+}
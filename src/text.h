@@ -4,6 +4,7 @@
 #include <iostream>
 #include <string>
 #include <vector>
+#include <unordered_map>
 
 #include <ft2build.h>
 #include FT_FREETYPE_H
@@ -16,6 +17,7 @@
 #include "stb_image_write.h"
 
 #include "rect.h"
+#include "font.h"
 
 
 struct Character
@@ -25,19 +27,195 @@ struct Character
     glm::ivec2 bearing;
     glm::ivec2 size;
     unsigned int advance;
+    uint32_t page; // Index into CharacterAtlas::pages, always 0 for pinned ASCII
+};
+
+const uint32_t CLAY_GLYPH_PINNED_CODEPOINTS = 128; // ASCII, always resident
+
+const uint32_t CLAY_INVALID_CODEPOINT = 0xFFFFFFFF;
+
+const uint32_t CLAY_GLYPH_MAX_PAGES = 4;          // Pages an atlas grows to before the least recently used one is evicted
+const uint32_t CLAY_GLYPH_MAX_INDEX = 1u << 14;   // Glyph indices per atlas, see CLAY_GLYPH_INDEX_BITS
+
+// Layout metrics of a glyph in atlas pixels
+struct GlyphMetrics
+{
+    float left;    // Ink extent from the pen position, both 0 for glyphs without ink
+    float right;
+    float advance;
+};
+
+struct SkylineNode
+{
+    uint32_t x;
+    uint32_t y;
+    uint32_t width;
+};
+
+// Bottom-left skyline rectangle packer, the skyline is the top edge of everything placed so far
+struct SkylinePacker
+{
+    uint32_t width = 0;
+    uint32_t height = 0;
+    std::vector<SkylineNode> skyline;
+    uint64_t used_area = 0;
+};
+
+void skyline_init(SkylinePacker* packer, uint32_t width, uint32_t height);
+
+// Returns false and leaves the packer unchanged when the rectangle does not fit
+bool skyline_pack(SkylinePacker* packer, uint32_t width, uint32_t height, uint32_t* x, uint32_t* y);
+
+// Fraction of the page covered by packed rectangles
+float skyline_efficiency(const SkylinePacker* packer);
+
+const uint32_t GLYPH_TABLE_EMPTY = 0xFFFFFFFF;
+
+// Open addressing hash from codepoint to glyph slot, linear probing with backward shift deletion
+struct GlyphTable
+{
+    std::vector<uint32_t> keys;
+    std::vector<uint32_t> values;
+    uint32_t bits = 0;
+    uint32_t count = 0; // Grows at half load
+};
+
+// A glyph outside the pinned ASCII range, rasterized on first use and packed at its own size on character.page
+struct GlyphSlot
+{
+    Character character;
+    uint32_t last_used; // Frame stamp, glyphs used in the current frame are never evicted
+    bool occupied;
+};
+
+// One texture of an atlas. Page 0 starts with the pinned ASCII glyphs, dynamic glyphs are packed onto any page
+// as they arrive and a new page is added when none has room
+struct AtlasPage
+{
+    uint32_t texture_id = 0;
+    uint32_t width = 0;
+    uint32_t height = 0;
+    std::vector<uint8_t> pixels; // CPU copy of the texture, changed rows are uploaded by upload_atlas_page
+    uint32_t dirty_top = 0;
+    uint32_t dirty_bot = 0;
+
+    SkylinePacker packer;
+    std::vector<SkylineNode> base_skyline; // Skyline after the pinned glyphs, restored when the page is evicted
+    uint64_t base_area = 0;
+    uint64_t ink_area = 0;      // Bitmap pixels of the glyphs on the page, without their borders
+    uint64_t base_ink_area = 0; // Of the pinned glyphs alone
+    uint32_t glyphs = 0;    // Dynamic glyphs on the page
+    uint32_t last_used = 0; // Latest frame stamp of any of them, pages used in the current frame are never evicted
+};
+
+struct GlyphCacheStats
+{
+    uint32_t hits = 0;
+    uint32_t misses = 0;
+    uint32_t evictions = 0; // Glyphs dropped with their page
+    uint32_t failures = 0;  // FreeType could not load the glyph, or CLAY_GLYPH_MAX_INDEX glyphs were resident
 };
 
 struct CharacterAtlas
 {
-    uint32_t texture_id;
-    std::vector<Character> characters;
+    std::vector<Character> characters; // ASCII, always resident and indexed by codepoint
+    GlyphMetrics ascii_metrics[CLAY_GLYPH_PINNED_CODEPOINTS]; // Read by MeasureText without touching characters
+    float numeric_advances[CLAY_GLYPH_PINNED_CODEPOINTS]; // Advances in numeric labels, every digit takes the widest digit's
     float ascender;
     float descender;
     float line_height;
+
+    // Signed distance field glyphs rasterized once at pixel_size and scaled to any font size in ui.frag.
+    // Bitmaps, bearings and advances stay in atlas pixels, each glyph bitmap is grown by sdf_spread on every side
+    bool sdf = false;
+    uint16_t pixel_size = 0;
+    float sdf_spread = 0.0f;
+
+    FontFace* font = nullptr; // Shared with every other atlas of the same file
+    FT_Face face = nullptr;   // Face glyphs are loaded from, a worker's own face until finish_character_atlas
+    FT_Size size = nullptr;   // Owned by face, activated before each glyph load
+
+    // Power of two pages, pinned ASCII glyphs are packed on page 0 and dynamic glyphs wherever they fit when first used
+    std::vector<AtlasPage> pages;
+    uint32_t max_texture_size = 0;
+    float packing_efficiency = 0.0f; // Glyph bitmap pixels over the area of every page
+    size_t texture_bytes = 0;        // Every page, pages are never freed so this is also the peak
+
+    std::vector<GlyphSlot> slots;
+    std::vector<uint32_t> free_slots;
+    GlyphTable table;
+    GlyphCacheStats cache_stats;
+
+    // Pair kerning in 26.6 atlas pixels, grid fitted unless sdf. Read through glyph_kerning
+    bool kerned = false;               // The face has a kerning table
+    std::vector<int16_t> ascii_kerning; // [left * CLAY_GLYPH_PINNED_CODEPOINTS + right], empty when no ASCII pair is kerned
+    std::unordered_map<uint64_t, int16_t> kerning_cache; // Pairs with a codepoint outside ASCII, looked up on first use
+
+    // Two RGBA32F texels per glyph index for instanced text: uv bounds on the glyph's page, then bearing.x, -bearing.y,
+    // size.x, size.y. Glyph index is the codepoint for pinned ASCII and CLAY_GLYPH_PINNED_CODEPOINTS plus the slot otherwise
+    std::vector<glm::vec4> instance_metrics;
+    uint32_t metrics_buffer = 0;
+    uint32_t metrics_capacity = 0; // Texels metrics_buffer has room for
+    uint32_t metrics_texture = 0; // Buffer texture over metrics_buffer, read by ui.vert
+    uint32_t metrics_dirty_first = 0; // Glyph indices written since the last upload
+    uint32_t metrics_dirty_last = 0;
 };
 
-int create_character_atlas(CharacterAtlas* atlas, std::string font_filepath, uint16_t font_size);
+int create_character_atlas(CharacterAtlas* atlas, FontFace* font, uint16_t font_size, bool sdf = false);
+
+// CPU half of create_character_atlas, rasterizes and packs the pinned glyphs without touching GL.
+// Safe on any thread as long as no other thread uses face at the same time
+int build_character_atlas(CharacterAtlas* atlas, FT_Face face, uint16_t font_size, bool sdf, uint32_t max_texture_size);
+
+// GL half, on the context thread. Moves the atlas onto the shared font face and creates its textures
+int finish_character_atlas(CharacterAtlas* atlas, FontFace* font);
+
+// Returns nullptr when FreeType cannot load the glyph or CLAY_GLYPH_MAX_INDEX glyphs are resident, pages may be
+// added, so call grow_character_atlas before drawing. The pointer is valid until the next call.
+// glyph_index receives the glyph's index into instance_metrics, valid until the glyph is evicted
+const Character* get_character(CharacterAtlas* atlas, uint32_t codepoint, uint32_t frame, uint32_t* glyph_index = nullptr);
+
+// Creates textures for pages added by get_character and grows the metrics buffer to every slot, before anything
+// refers to them. Returns true when it bound GL objects, a caller mirroring GL state must reset its mirror
+bool grow_character_atlas(CharacterAtlas* atlas);
+
+// Uploads rows of the page changed by get_character, the page's texture must be bound to the active texture unit
+void upload_atlas_page(CharacterAtlas* atlas, uint32_t page);
+
+// Uploads instance metrics changed by get_character, after grow_character_atlas
+void upload_instance_metrics(CharacterAtlas* atlas);
+
+bool atlas_page_dirty(const AtlasPage* page);
+
+// Any page or the instance metrics
+bool character_atlas_dirty(const CharacterAtlas* atlas);
+
+GlyphMetrics glyph_metrics(const CharacterAtlas* atlas, const Character& character);
+
+// Pen adjustment in atlas pixels between two consecutive codepoints, used by both measuring and drawing so
+// wrapping matches what is drawn. 0 when either is CLAY_INVALID_CODEPOINT
+float glyph_kerning(CharacterAtlas* atlas, uint32_t left, uint32_t right);
+
+// Decodes the codepoint at *offset and moves past it. Malformed sequences, surrogates and out of range
+// values give CLAY_INVALID_CODEPOINT, a sequence cut off by the end of the text consumes the rest
+uint32_t next_codepoint(const char* text, size_t length, size_t* offset);
+
+const uint32_t CLAY_BAKED_ATLAS_VERSION = 4;
+
+// Changes with the font contents and every setting that affects the rasterized atlas
+uint64_t baked_atlas_key(const FontFace* font, uint16_t font_size, bool sdf);
+
+// Writes the pinned glyphs, metrics and page 0 with its skyline. Call after building, before any dynamic glyph is added
+int save_baked_atlas(const CharacterAtlas* atlas, const std::string& filepath, uint64_t key);
+
+// Alternative to build_character_atlas that maps a file written by save_baked_atlas. -1 if it is missing, stale or corrupt
+int load_baked_atlas(CharacterAtlas* atlas, const std::string& filepath, uint64_t key);
+
+// Writes at most length codepoints, so codepoints needs room for length entries. Returns how many were written.
+// Pure ASCII blocks are checked and widened 16 or 32 bytes at a time with SSE2, AVX2 or NEON when available
+size_t decode_utf8(const char* text, size_t length, uint32_t* codepoints);
 
+// Appends to codepoints
 void utf8_to_codepoints(const std::string& text, std::vector<uint32_t>& codepoints);
 
 